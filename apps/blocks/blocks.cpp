@@ -95,14 +95,10 @@ extern "C" void main(int argc, char** argv) {
         }
         WinRedraw(layer_id);
 
-        static unsigned long prev_timeout = 0;
-        if (prev_timeout == 0) {
-            const auto timeout =
-                SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-            prev_timeout = timeout.value;
-        } else {
-            prev_timeout += 1000 / kFrameRate;
-            SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+        static bool started = false;
+        if (!started) {
+            SyscallCreateTimerNs(TIMER_PERIODIC, 1, 1000000000 / kFrameRate);
+            started = true;
         }
 
         Message msg[1];
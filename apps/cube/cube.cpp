@@ -166,13 +166,11 @@ void DrawSurface(uint64_t layer_id, bool draw, int sur) {
 }
 
 bool Sleep(unsigned long ms) {
-    static unsigned long prev_timeout = 0;
-    if (prev_timeout == 0) {
-        const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
-        prev_timeout = timeout.value;
-    } else {
-        prev_timeout += ms;
-        SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+    // the frame timer is periodic, so ms only counts on the first call
+    static bool started = false;
+    if (!started) {
+        SyscallCreateTimerNs(TIMER_PERIODIC, 1, ms * 1000000);
+        started = true;
     }
 
     Message msg[1];
@@ -0,0 +1,45 @@
+#include <fcntl.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../../libs/kinos/common/syscall.h"
+
+namespace {
+uint64_t ReadTSC() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+}  // namespace
+
+// measures request/response round trips between an application and am.
+// opening "@stdin" is answered by am itself without involving fs.
+extern "C" void main(int argc, char** argv) {
+    int rounds = 1000;
+    if (argc >= 2) {
+        rounds = atoi(argv[1]);
+    }
+    if (rounds <= 0) {
+        printf("Usage: ipcbench [rounds]\n");
+        exit(1);
+    }
+
+    auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+    const uint64_t tsc_start = ReadTSC();
+    for (int i = 0; i < rounds; ++i) {
+        if (open("@stdin", O_RDONLY) < 0) {
+            printf("open failed at round %d\n", i);
+            exit(1);
+        }
+    }
+    const uint64_t tsc_end = ReadTSC();
+    auto tick_end = SyscallGetCurrentTick();
+
+    const uint64_t elapsed_ms =
+        (tick_end.value - tick_start) * 1000 / timer_freq;
+    printf("%d round trips in %lu ms, %lu cycles per round trip\n", rounds,
+           elapsed_ms, (tsc_end - tsc_start) / rounds);
+    exit(0);
+}
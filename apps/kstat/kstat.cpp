@@ -0,0 +1,73 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../../libs/kinos/common/syscall.h"
+
+extern "C" void main(int argc, char** argv) {
+    IPCStat ipc;
+    if (auto [n, err] = SyscallGetStat(kStatIPC, &ipc, sizeof(ipc)); err) {
+        printf("cannot get ipc stat\n");
+        exit(1);
+    }
+
+    printf("ipc: sent %lu, handoffs %lu, deferred %lu\n", ipc.sent,
+           ipc.handoffs, ipc.deferred);
+    printf("irq: dropped %lu, coalesced %lu\n", ipc.irq_dropped,
+           ipc.irq_coalesced);
+
+    SyscallStat sys;
+    if (auto [n, err] = SyscallGetStat(kStatSyscall, &sys, sizeof(sys)); err) {
+        printf("cannot get syscall stat\n");
+        exit(1);
+    }
+    printf("syscall calls:\n");
+    for (int i = 0; i < kSyscallStatCount; ++i) {
+        if (sys.calls[i] != 0) {
+            printf("  0x%02x: %lu\n", i, sys.calls[i]);
+        }
+    }
+
+    CPUStat cpu;
+    if (auto [n, err] = SyscallGetStat(kStatCPU, &cpu, sizeof(cpu)); err) {
+        printf("cannot get cpu stat\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < cpu.cpus; ++i) {
+        const auto& c = cpu.cpu[i];
+        const auto ticks = c.busy_ticks + c.idle_ticks;
+        printf("cpu%lu: busy %lu%%, timer irqs %lu, queued %lu, steals %lu, "
+               "stolen %lu, affine %lu\n",
+               i, ticks ? c.busy_ticks * 100 / ticks : 0, c.timer_interrupts,
+               c.queued, c.steals, c.stolen, c.affine_wakeups);
+        printf("  switches %lu, %lu cycles each\n", c.switches,
+               c.switches ? c.switch_cycles / c.switches : 0);
+    }
+
+    PageFaultStat pf;
+    if (auto [n, err] = SyscallGetStat(kStatPageFault, &pf, sizeof(pf)); err) {
+        printf("cannot get page fault stat\n");
+        exit(1);
+    }
+    printf("page faults: %lu, %lu ns each\n", pf.faults,
+           pf.faults ? pf.fault_ns / pf.faults : 0);
+    printf("  demand %lu (around %lu), zero %lu, file %lu, cow %lu, "
+           "populated %lu\n",
+           pf.demand_pages, pf.around_pages, pf.zero_maps, pf.file_pages,
+           pf.copies, pf.populated_pages);
+    printf("  2 MiB pages %lu, split %lu\n", pf.large_pages, pf.large_splits);
+
+    SlabStats slab;
+    if (auto [n, err] = SyscallGetStat(kStatSlab, &slab, sizeof(slab)); err) {
+        printf("cannot get slab stat\n");
+        exit(1);
+    }
+    printf("slab caches (objects in use/per slab, slabs, allocs, frees):\n");
+    for (uint64_t i = 0; i < slab.caches && i < kSlabStatCount; ++i) {
+        const auto& c = slab.cache[i];
+        printf("  %-16s %4lu bytes %lu/%lu, %lu, %lu, %lu\n", c.name,
+               c.object_size, c.active_objects, c.objects_per_slab, c.slabs,
+               c.allocations, c.frees);
+    }
+    exit(0);
+}
@@ -84,6 +84,7 @@ ssize_t readdir(int fd, void* buf) {
         smsg.type = Message::kRead;
         smsg.arg.read.fd = fd;
         smsg.arg.read.count = 8 + 1;  // dir name length max is 8 + 1
+        smsg.arg.read.grant = 0;
         SyscallSendMessage(&smsg, id.value);
 
         size_t read_bytes = 0;
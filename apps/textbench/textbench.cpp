@@ -0,0 +1,63 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../../libs/kinos/app/gui/guisyscall.hpp"
+
+namespace {
+uint64_t CountSyscalls() {
+    SyscallStat stat;
+    if (auto [n, err] = SyscallGetStat(kStatSyscall, &stat, sizeof(stat));
+        err) {
+        return 0;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < kSyscallStatCount; ++i) {
+        total += stat.calls[i];
+    }
+    return total;
+}
+}  // namespace
+
+// draws the same text one character per send and as a batched string, and
+// reports how many system calls each way took. the counts are system wide,
+// so other tasks running at the same time inflate them a little.
+extern "C" void main(int argc, char** argv) {
+    int lines = 16;
+    if (argc >= 2) {
+        lines = atoi(argv[1]);
+    }
+    if (lines <= 0) {
+        printf("Usage: textbench [lines]\n");
+        exit(1);
+    }
+
+    int layer_id = OpenWindow(400, 60, 10, 10, "textbench");
+    if (layer_id == -1) {
+        exit(1);
+    }
+
+    char text[] = "The quick brown fox jumps over the lazy dog";
+    const int len = strlen(text);
+
+    uint64_t start = CountSyscalls();
+    for (int i = 0; i < lines; ++i) {
+        for (int j = 0; j < len; ++j) {
+            WinWriteChar(layer_id, true, 4 + 8 * j, 24, 0xffffff, text[j]);
+        }
+    }
+    const uint64_t per_char = CountSyscalls() - start;
+
+    start = CountSyscalls();
+    for (int i = 0; i < lines; ++i) {
+        WinWriteString(layer_id, true, 4, 40, 0xffffff, text);
+    }
+    const uint64_t batched = CountSyscalls() - start;
+
+    printf("%d lines of %d chars\n", lines, len);
+    printf("per char: %lu syscalls, batched: %lu syscalls\n", per_char,
+           batched);
+    CloseWindow(layer_id);
+    exit(0);
+}
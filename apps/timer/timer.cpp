@@ -11,18 +11,7 @@ extern "C" void main(int argc, char** argv) {
     }
 
     const unsigned long duration_ms = atoi(argv[1]);
-    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms);
-    printf("timer created. timeout = %lu\n", timeout.value);
-
-    Message msg[1];
-    while (true) {
-        SyscallOpenReceiveMessage(msg, 1);
-        if (msg[0].type == Message::kTimerTimeout) {
-            printf("%lu msecs elapsed!\n", duration_ms);
-            break;
-        } else {
-            printf("unknown event: type = %d\n", msg[0].type);
-        }
-    }
+    SyscallSleep(duration_ms * 1000000);
+    printf("%lu msecs elapsed!\n", duration_ms);
     exit(0);
 }
\ No newline at end of file
@@ -66,6 +66,7 @@ size_t XSDT::Count() const {
 }
 
 const FADT* fadt;
+const MADT* madt;
 
 void Initialize(const RSDP& rsdp) {
     if (!rsdp.IsValid()) {
@@ -80,12 +81,14 @@ void Initialize(const RSDP& rsdp) {
     }
 
     fadt = nullptr;
+    madt = nullptr;
 
     for (int i = 0; i < xsdt.Count(); ++i) {
         const auto& entry = xsdt[i];
-        if (entry.Isvalid("FACP")) {
+        if (fadt == nullptr && entry.Isvalid("FACP")) {
             fadt = reinterpret_cast<const FADT*>(&entry);
-            break;
+        } else if (madt == nullptr && entry.Isvalid("APIC")) {
+            madt = reinterpret_cast<const MADT*>(&entry);
         }
     }
 
@@ -109,5 +112,33 @@ void WaitMilliseconds(unsigned long msec) {
     while (IoIn32(fadt->pm_tmr_blk) < end);
 }
 
+size_t FindLocalAPICIDs(uint8_t* apic_ids, size_t max_count) {
+    if (madt == nullptr) {
+        return 0;
+    }
+
+    size_t count = 0;
+    auto p = reinterpret_cast<const uint8_t*>(madt + 1);
+    const auto end =
+        reinterpret_cast<const uint8_t*>(madt) + madt->header.length;
+    while (p + 2 <= end && count < max_count) {
+        const uint8_t type = p[0];
+        const uint8_t length = p[1];
+        if (length < 2) {
+            break;
+        }
+        // type 0: processor local APIC {processor id, APIC id, flags}
+        if (type == 0 && length >= 8) {
+            uint32_t flags;
+            memcpy(&flags, p + 4, sizeof(flags));
+            if (flags & 1) {
+                apic_ids[count++] = p[3];
+            }
+        }
+        p += length;
+    }
+    return count;
+}
+
 
 }
\ No newline at end of file
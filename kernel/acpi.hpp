@@ -50,9 +50,24 @@ struct FADT {
     char reserved3[276 - 116];
 } __attribute__((packed));
 
+struct MADT {
+    DescriptionHeader header;
+
+    uint32_t lapic_address;
+    uint32_t flags;
+    // followed by interrupt controller structures
+} __attribute__((packed));
+
 extern const FADT* fadt;
+extern const MADT* madt;
 const int kPMTimerFreq = 3579545;
 
 void WaitMilliseconds(unsigned long msec);
+/** @brief stores the local APIC IDs of the enabled processors
+ *
+ * Returns the number of IDs stored, at most max_count. Without a MADT only
+ * the running processor is known and 0 is returned.
+ */
+size_t FindLocalAPICIDs(uint8_t* apic_ids, size_t max_count);
 void Initialize(const RSDP& rsdp);
 }  // namespace acpi
\ No newline at end of file
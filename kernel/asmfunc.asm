@@ -97,6 +97,58 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global SetXCR0  ; void SetXCR0(uint64_t value);
+SetXCR0:
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx
+    xsetbv
+    ret
+
+extern fpu_save_mode
+extern fpu_area_size
+
+; FPU/SSE/AVX の状態を 64 バイト境界の領域に保存・復元する
+; fpu_save_mode: 0 = FXSAVE, 1 = XSAVE, 2 = XSAVEOPT（RAX, RDX を破壊する）
+%macro SaveFPU 1  ; 領域のアドレスを持つレジスタ
+    cmp byte [rel fpu_save_mode], 1
+    jb %%fxsave
+    mov eax, 0xffffffff
+    mov edx, eax
+    je %%xsave
+    xsaveopt [%1]
+    jmp %%done
+%%xsave:
+    xsave [%1]
+    jmp %%done
+%%fxsave:
+    fxsave [%1]
+%%done:
+%endmacro
+
+%macro RestoreFPU 1  ; 領域のアドレスを持つレジスタ
+    cmp byte [rel fpu_save_mode], 0
+    je %%fxrstor
+    mov eax, 0xffffffff
+    mov edx, eax
+    xrstor [%1]
+    jmp %%done
+%%fxrstor:
+    fxrstor [%1]
+%%done:
+%endmacro
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -148,11 +200,24 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov [rsi + 0x38], rdx
 
 
-    fxsave [rsi + 0xc0]
+    mov rcx, [rsi + 0xc0]  ; xsave_area
+    SaveFPU rcx
     ; fall through to RestoreContext
 
+extern GetCurrentSwitchStack
+extern FinishContextSwitch
+extern SwitchAddressSpace
+
 global RestoreContext
 RestoreContext:  ; void RestoreContext(void* task_context);
+    ; task_lock を握ったまま呼ばれる
+    ; 前のタスクのスタックを手放してから task_lock を解放する
+    mov rbx, rdi
+    and rsp, 0xfffffffffffffff0
+    call GetCurrentSwitchStack
+    mov rsp, rax
+    mov rdi, rbx
+
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
 
@@ -161,11 +226,16 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     push qword [rdi + 0x20] ; CS
     push qword [rdi + 0x08] ; RIP
 
+    sub rsp, 8
+    mov rdi, [rbx + 0x00]  ; CR3
+    call SwitchAddressSpace
+    call FinishContextSwitch
+    add rsp, 8
+    mov rdi, rbx
 
-    fxrstor [rdi + 0xc0]
+    mov rcx, [rdi + 0xc0]  ; xsave_area
+    RestoreFPU rcx
 
-    mov rax, [rdi + 0x00]
-    mov cr3, rax
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -211,17 +281,23 @@ CallApp:  ; void CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint6
     ; アプリケーションが終了してもここには来ない
 
 
-extern LAPICTimerOnInterrupt
-; void LAPICTimerOnInterrupt(const TaskContext& ctx_stack);
-
-global IntHandlerLAPICTimer
-IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
+; 割り込み時のスタック上に TaskContext 型の構造を構築して handler を呼ぶ
+; void handler(const TaskContext& ctx_stack);
+%macro ContextInterruptHandler 2  ; entry, handler
+extern %2
+global %1
+%1:
     push rbp
     mov rbp, rsp
 
     ; スタック上に TaskContext 型の構造を構築する
-    sub rsp, 512
-    fxsave [rsp]
+    ; FPU の保存領域は 64 バイト境界に置き，GPR を積んでから保存する
+    sub rsp, [rel fpu_area_size]
+    and rsp, 0xffffffffffffffc0
+    ; 25 個積むので 8 バイト詰めて call 時の RSP を 16 バイト境界に揃える
+    sub rsp, 8
+    push rsp                 ; xsave_area
+    add qword [rsp], 8
     push r15
     push r14
     push r13
@@ -252,8 +328,21 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push qword [rbp + 0x08]  ; RIP
     push rcx                 ; CR3
 
+    ; XSAVE ヘッダの XSTATE_BV 以外は 0 でなければならない
+    cld
+    mov rdi, [rsp + 0xc0]
+    add rdi, 512 + 8
+    xor eax, eax
+    mov ecx, 7
+    rep stosq
+    mov rcx, [rsp + 0xc0]
+    SaveFPU rcx
+
     mov rdi, rsp
-    call LAPICTimerOnInterrupt
+    call %2
+
+    mov rcx, [rsp + 0xc0]
+    RestoreFPU rcx
 
     add rsp, 8*8  ; CR3 から GS までを無視
     pop rax
@@ -271,11 +360,14 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
+%endmacro
+
+ContextInterruptHandler IntHandlerLAPICTimer, LAPICTimerOnInterrupt
+ContextInterruptHandler IntHandlerReschedule, RescheduleOnInterrupt
 
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
@@ -291,8 +383,8 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
-extern GetCurrentTaskOSStackPointer
 extern syscall_table
+extern syscall_count
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
     push rbp
@@ -306,12 +398,15 @@ SyscallEntry:  ; void SyscallEntry(void);
     mov rbp, rsp
 
     ; システムコールを OS 用スタックで実行するための準備
+    ; IF は FMASK で落ちているので GS を戻すまで割り込まれない
     and rsp, 0xfffffffffffffff0
     push rax
     push rdx
-    cli
-    call GetCurrentTaskOSStackPointer
+    swapgs
+    mov rax, [gs:0x00]  ; PerCPUData::os_stack_ptr
+    swapgs
     sti
+    mov rax, [rax]
     mov rdx, [rsp + 0]  ; RDX
     mov [rax - 16], rdx
     mov rdx, [rsp + 8]  ; RAX
@@ -322,6 +417,10 @@ SyscallEntry:  ; void SyscallEntry(void);
     pop rax
     and rsp, 0xfffffffffffffff0
 
+    cmp eax, 64  ; kSyscallStatCount
+    jae .dispatch
+    lock inc qword [syscall_count + 8 * eax]
+.dispatch:
     call [syscall_table + 8 * eax]
     ; rbx, r12-r15 は callee-saved なので呼び出し側で保存しない
     ; rax は戻り値用なので呼び出し側で保存しない
@@ -368,4 +467,93 @@ ExitApp:
 global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi]
-    ret
\ No newline at end of file
+    ret
+
+; アプリケーションプロセッサの起動コード
+; InitializeSMP が 1 MiB 未満のページにコピーし、SIPI でそこから実行させる
+; コピー先のアドレスは実行時まで分からないので位置独立に書く
+global APTrampoline
+global APTrampolineParams
+global APTrampolineEnd
+
+bits 16
+APTrampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4  ; ebx = コピー先の物理アドレス
+
+    ; 絶対アドレスを書き込む
+    lea eax, [ebx + .gdt - APTrampoline]
+    mov [.gdtr - APTrampoline + 2], eax
+    lea eax, [ebx + .pm - APTrampoline]
+    mov [.pm_ptr - APTrampoline], eax
+    lea eax, [ebx + .lm - APTrampoline]
+    mov [.lm_ptr - APTrampoline], eax
+
+    o32 lgdt [.gdtr - APTrampoline]
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    o32 jmp far [.pm_ptr - APTrampoline]
+
+bits 32
+.pm:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, 1 << 5  ; PAE
+    mov cr4, eax
+    mov eax, [ebx + APTrampolineParams - APTrampoline]  ; CR3
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+    mov eax, [ebx + APTrampolineParams - APTrampoline + 8]  ; CR0
+    mov cr0, eax
+    jmp far [ebx + .lm_ptr - APTrampoline]
+
+bits 64
+.lm:
+    mov ebx, ebx  ; 上位 32 ビットをクリア
+    mov rax, [rbx + APTrampolineParams - APTrampoline + 16]  ; CR4
+    mov cr4, rax
+    mov rsp, [rbx + APTrampolineParams - APTrampoline + 24]  ; stack
+    mov rdi, [rbx + APTrampolineParams - APTrampoline + 40]  ; arg
+    call [rbx + APTrampolineParams - APTrampoline + 32]      ; entry
+.fin:
+    hlt
+    jmp .fin
+
+.pm_ptr:
+    dd 0
+    dw 0x18
+.lm_ptr:
+    dd 0
+    dw 0x08
+
+align 8
+.gdt:
+    dq 0
+    dq 0x00af9a000000ffff  ; 0x08: 64 ビットコード
+    dq 0x00cf92000000ffff  ; 0x10: データ
+    dq 0x00cf9a000000ffff  ; 0x18: 32 ビットコード
+.gdtr:
+    dw .gdtr - .gdt - 1
+    dd 0
+
+align 8
+APTrampolineParams:  ; struct APStartParams
+    dq 0  ; CR3
+    dq 0  ; CR0
+    dq 0  ; CR4
+    dq 0  ; stack
+    dq 0  ; entry
+    dq 0  ; arg
+APTrampolineEnd:
\ No newline at end of file
@@ -15,6 +15,9 @@ void SetCR0(uint64_t value);
 uint64_t GetCR2();
 void SetCR3(uint64_t value);
 uint64_t GetCR3();
+uint64_t GetCR4();
+void SetCR4(uint64_t value);
+void SetXCR0(uint64_t value);
 void SwitchContext(void* next_ctx, void* current_ctx);
 void RestoreContext(void* ctx);
 
@@ -33,9 +36,15 @@ int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp,
             uint64_t* os_stack_ptr);
 
 void IntHandlerLAPICTimer();
+void IntHandlerReschedule();
 void LoadTR(uint16_t sel);
 void WriteMSR(uint32_t msr, uint64_t value);
 void SyscallEntry(void);
 void ExitApp(uint64_t rsp, int32_t ret_val);
 void InvalidateTLB(uint64_t addr);
+
+// startup code of the application processors, copied below 1 MiB
+extern const uint8_t APTrampoline[];
+extern const uint8_t APTrampolineParams[];
+extern const uint8_t APTrampolineEnd[];
 }
\ No newline at end of file
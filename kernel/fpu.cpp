@@ -0,0 +1,52 @@
+#include "fpu.hpp"
+
+#include <cpuid.h>
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "slab.hpp"
+
+namespace {
+const uint64_t kXCR0x87 = 1u << 0;
+const uint64_t kXCR0SSE = 1u << 1;
+const uint64_t kXCR0AVX = 1u << 2;
+
+SlabCache* area_cache;
+}  // namespace
+
+FPUSaveMode fpu_save_mode = kFXSave;
+uint64_t fpu_area_size = 576;  // FXSAVE image and the unused XSAVE header
+
+void InitializeFPU() {
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (ecx & bit_XSAVE) {
+        uint64_t xcr0 = kXCR0x87 | kXCR0SSE;
+        if (ecx & bit_AVX) {
+            xcr0 |= kXCR0AVX;
+        }
+        SetCR4(GetCR4() | (1u << 18));  // OSXSAVE
+        SetXCR0(xcr0);
+
+        // EBX is the size of the area for the components enabled in XCR0
+        __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+        fpu_area_size = ebx;
+        __cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+        fpu_save_mode = (eax & bit_XSAVEOPT) ? kXSaveOpt : kXSave;
+    }
+
+    if (area_cache == nullptr) {
+        area_cache = new SlabCache{"fpu", fpu_area_size, 64};
+    }
+}
+
+uint8_t* AllocateFPUArea() {
+    auto area = reinterpret_cast<uint8_t*>(area_cache->Allocate());
+    if (area) {
+        memset(area, 0, fpu_area_size);
+    }
+    return area;
+}
+
+void FreeFPUArea(uint8_t* area) { area_cache->Free(area); }
@@ -0,0 +1,34 @@
+/**
+ * @file fpu.hpp
+ *
+ * Saving and restoring the FPU/SSE/AVX state on context switches.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/** @brief instruction asmfunc.asm uses for the FPU area of a TaskContext */
+enum FPUSaveMode : uint8_t {
+    kFXSave,
+    kXSave,
+    // skips the parts that are unmodified since the last XRSTOR or still in
+    // their initial state
+    kXSaveOpt,
+};
+
+extern "C" FPUSaveMode fpu_save_mode;
+/** @brief bytes of an FPU area; depends on the state components in XCR0 */
+extern "C" uint64_t fpu_area_size;
+
+/** @brief enables XSAVE and AVX on the running CPU if it has them
+ *
+ * Every CPU calls this before its first context switch. The BSP also
+ * decides the size of the FPU areas.
+ */
+void InitializeFPU();
+
+/** @brief returns a zeroed, 64-byte aligned FPU area or nullptr */
+uint8_t* AllocateFPUArea();
+void FreeFPUArea(uint8_t* area);
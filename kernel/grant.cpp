@@ -0,0 +1,166 @@
+#include "grant.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "paging.hpp"
+#include "slab.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+struct Grant {
+    Grant* next;
+    uint64_t id;
+    uint64_t owner;
+    uint64_t grantee;
+    uint64_t cr3;  // address space of the owner
+    uint64_t addr;
+    size_t len;
+    int flags;
+};
+
+SlabCache grant_cache{"grant", sizeof(Grant), alignof(Grant)};
+Grant* grants = nullptr;
+uint64_t latest_grant_id = 0;
+SpinLock grant_lock;
+
+Grant* FindGrant(uint64_t grant_id) {
+    for (auto g = grants; g != nullptr; g = g->next) {
+        if (g->id == grant_id) {
+            return g;
+        }
+    }
+    return nullptr;
+}
+
+void RemoveGrant(Grant* grant) {
+    for (auto p = &grants; *p != nullptr; p = &(*p)->next) {
+        if (*p == grant) {
+            *p = grant->next;
+            grant_cache.Free(grant);
+            return;
+        }
+    }
+}
+
+/** @brief copies between buf in the current address space and the grant,
+ * one page of the owner at a time */
+WithError<size_t> CopyGrant(uint64_t grantee_id, uint64_t grant_id,
+                            size_t offset, uint8_t* buf, size_t len,
+                            bool to_grant) {
+    size_t copied = 0;
+    while (true) {
+        SpinLockGuard guard{grant_lock};
+        auto grant = FindGrant(grant_id);
+        if (grant == nullptr || grant->grantee != grantee_id ||
+            !(grant->flags & (to_grant ? kGrantWrite : kGrantRead))) {
+            return {copied, MAKE_ERROR(Error::kNoSuchGrant)};
+        }
+        if (copied == len || offset + copied >= grant->len) {
+            break;
+        }
+
+        const uint64_t addr = grant->addr + offset + copied;
+        auto [phys, err] =
+            GetPhysicalAddress(PML4OfCR3(grant->cr3), addr, to_grant);
+        if (err) {
+            return {copied, err};
+        }
+
+        size_t n = 4096 - (addr & 4095);
+        n = std::min(n, len - copied);
+        n = std::min(n, grant->len - offset - copied);
+        auto p = reinterpret_cast<uint8_t*>(phys);
+        if (to_grant) {
+            memcpy(p, buf + copied, n);
+        } else {
+            memcpy(buf + copied, p, n);
+        }
+        copied += n;
+    }
+    return {copied, MAKE_ERROR(Error::kSuccess)};
+}
+}  // namespace
+
+WithError<uint64_t> CreateGrant(Task& owner, uint64_t addr, size_t len,
+                                uint64_t grantee, int flags) {
+    if (len == 0 || (flags & ~(kGrantRead | kGrantWrite)) != 0 ||
+        addr < 0xffff'8000'0000'0000 || addr + len < addr) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    if (task_manager->FindTask(grantee) == nullptr) {
+        return {0, MAKE_ERROR(Error::kNoSuchTask)};
+    }
+
+    const auto num_4kpages = ((addr & 4095) + len + 4095) / 4096;
+    if (auto err = PreparePageMaps(LinearAddress4Level{addr}, num_4kpages,
+                                   flags & kGrantWrite)) {
+        return {0, err};
+    }
+
+    SpinLockGuard guard{grant_lock};
+    auto grant = reinterpret_cast<Grant*>(grant_cache.Allocate());
+    if (grant == nullptr) {
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    grant->id = ++latest_grant_id;
+    grant->owner = owner.ID();
+    grant->grantee = grantee;
+    grant->cr3 = owner.Context().cr3;
+    grant->addr = addr;
+    grant->len = len;
+    grant->flags = flags;
+    grant->next = grants;
+    grants = grant;
+    return {grant->id, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error RevokeGrant(uint64_t owner_id, uint64_t grant_id) {
+    SpinLockGuard guard{grant_lock};
+    auto grant = FindGrant(grant_id);
+    if (grant == nullptr || grant->owner != owner_id) {
+        return MAKE_ERROR(Error::kNoSuchGrant);
+    }
+    RemoveGrant(grant);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error PassGrant(uint64_t grantee_id, uint64_t grant_id, uint64_t new_grantee) {
+    SpinLockGuard guard{grant_lock};
+    auto grant = FindGrant(grant_id);
+    if (grant == nullptr || grant->grantee != grantee_id) {
+        return MAKE_ERROR(Error::kNoSuchGrant);
+    }
+    if (task_manager->FindTask(new_grantee) == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    grant->grantee = new_grantee;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void ReleaseGrants(uint64_t owner_id) {
+    SpinLockGuard guard{grant_lock};
+    for (auto p = &grants; *p != nullptr;) {
+        auto grant = *p;
+        if (grant->owner == owner_id) {
+            *p = grant->next;
+            grant_cache.Free(grant);
+        } else {
+            p = &grant->next;
+        }
+    }
+}
+
+WithError<size_t> CopyFromGrant(uint64_t grantee_id, uint64_t grant_id,
+                                size_t offset, void* buf, size_t len) {
+    return CopyGrant(grantee_id, grant_id, offset,
+                     reinterpret_cast<uint8_t*>(buf), len, false);
+}
+
+WithError<size_t> CopyToGrant(uint64_t grantee_id, uint64_t grant_id,
+                              size_t offset, const void* buf, size_t len) {
+    return CopyGrant(grantee_id, grant_id, offset,
+                     reinterpret_cast<uint8_t*>(const_cast<void*>(buf)), len,
+                     true);
+}
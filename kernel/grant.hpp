@@ -0,0 +1,37 @@
+/**
+ * @file grant.hpp
+ *
+ * Lending pages of a task to another task for bulk data transfer.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+class Task;
+
+// must match GRANT_READ and GRANT_WRITE in syscall.h
+const int kGrantRead = 1;
+const int kGrantWrite = 2;
+
+/** @brief lends [addr, addr + len) of owner to grantee
+ *
+ * The pages are mapped in at this point, so owner has to be the current
+ * task. The grantee copies data in and out with CopyFromGrant/CopyToGrant,
+ * which go through the owner's page tables.
+ */
+WithError<uint64_t> CreateGrant(Task& owner, uint64_t addr, size_t len,
+                                uint64_t grantee, int flags);
+Error RevokeGrant(uint64_t owner_id, uint64_t grant_id);
+/** @brief hands a grant over to another task, e.g. from am to fs */
+Error PassGrant(uint64_t grantee_id, uint64_t grant_id, uint64_t new_grantee);
+/** @brief drops every grant owned by the task; called before its pages go */
+void ReleaseGrants(uint64_t owner_id);
+
+WithError<size_t> CopyFromGrant(uint64_t grantee_id, uint64_t grant_id,
+                                size_t offset, void* buf, size_t len);
+WithError<size_t> CopyToGrant(uint64_t grantee_id, uint64_t grant_id,
+                              size_t offset, const void* buf, size_t len);
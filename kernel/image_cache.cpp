@@ -0,0 +1,221 @@
+#include "image_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "elf.hpp"
+#include "memory_manager.hpp"
+#include "slab.hpp"
+#include "spinlock.hpp"
+
+struct ExecImage {
+    ExecImage* next;  // most recently used first
+    uint64_t hash;
+    size_t bytes;
+    FrameID data{0};  // copy of the file
+    size_t data_frames;
+    uint64_t first_page;  // pages covered by the PT_LOAD segments
+    size_t num_pages;
+    uintptr_t* pages;  // shared frames, 0 until first used
+    size_t refs;
+    SpinLock lock;  // guards pages
+};
+
+namespace {
+const size_t kMaxIdleImages = 4;
+
+SlabCache image_cache{"exec_image", sizeof(ExecImage), alignof(ExecImage)};
+ExecImage* images = nullptr;
+SpinLock image_lock;
+
+// FNV-1a over 8-byte words; it only picks the image to compare against
+uint64_t Hash(const uint8_t* p, size_t bytes) {
+    const uint64_t kPrime = 0x100'0000'01b3;
+    uint64_t h = 0xcbf2'9ce4'8422'2325;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h = (h ^ word) * kPrime;
+    }
+    for (; i < bytes; ++i) {
+        h = (h ^ p[i]) * kPrime;
+    }
+    return h;
+}
+
+const uint8_t* Data(const ExecImage* image) {
+    return reinterpret_cast<const uint8_t*>(image->data.Frame());
+}
+
+const Elf64_Phdr* ProgramHeaders(const uint8_t* file) {
+    auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(file);
+    return reinterpret_cast<const Elf64_Phdr*>(file + ehdr->e_phoff);
+}
+
+/** @brief checks that the segments lie in the file and finds their pages */
+bool LoadRange(const uint8_t* file, size_t bytes, uint64_t& first_page,
+               size_t& num_pages) {
+    if (bytes < sizeof(Elf64_Ehdr)) {
+        return false;
+    }
+    auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(file);
+    if (ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > bytes) {
+        return false;
+    }
+
+    auto phdr = ProgramHeaders(file);
+    uint64_t begin = ~0ul, end = 0;
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdr[i].p_type != PT_LOAD) continue;
+        if (phdr[i].p_offset + phdr[i].p_filesz > bytes ||
+            phdr[i].p_filesz > phdr[i].p_memsz) {
+            return false;
+        }
+        begin = std::min(begin, phdr[i].p_vaddr);
+        end = std::max(end, phdr[i].p_vaddr + phdr[i].p_memsz);
+    }
+    if (begin >= end) {
+        return false;
+    }
+    first_page = begin & ~0xffful;
+    num_pages = (end - first_page + 4095) / 4096;
+    return true;
+}
+
+void Destroy(ExecImage* image) {
+    for (size_t i = 0; i < image->num_pages; ++i) {
+        if (image->pages[i]) {
+            memory_manager->Free(FrameID{image->pages[i] / kBytesPerFrame},
+                                 1);
+        }
+    }
+    delete[] image->pages;
+    memory_manager->Free(image->data, image->data_frames);
+    image_cache.Free(image);
+}
+
+ExecImage* FindImage(uint64_t hash, size_t bytes) {
+    SpinLockGuard guard{image_lock};
+    for (auto p = &images; *p != nullptr; p = &(*p)->next) {
+        auto image = *p;
+        if (image->hash == hash && image->bytes == bytes) {
+            ++image->refs;
+            *p = image->next;
+            image->next = images;
+            images = image;
+            return image;
+        }
+    }
+    return nullptr;
+}
+}  // namespace
+
+WithError<ExecImage*> AcquireExecImage(const uint8_t* file, size_t bytes) {
+    uint64_t first_page;
+    size_t num_pages;
+    if (!LoadRange(file, bytes, first_page, num_pages)) {
+        return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+    }
+
+    // the comparison runs outside the lock; the reference keeps the
+    // candidate alive. After a hash collision the file is cached again.
+    const uint64_t hash = Hash(file, bytes);
+    if (auto image = FindImage(hash, bytes)) {
+        if (memcmp(Data(image), file, bytes) == 0) {
+            return {image, MAKE_ERROR(Error::kSuccess)};
+        }
+        ReleaseExecImage(image);
+    }
+
+    const size_t data_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto [data, err] = memory_manager->Allocate(data_frames);
+    if (err) {
+        return {nullptr, err};
+    }
+    memcpy(data.Frame(), file, bytes);
+
+    auto image = reinterpret_cast<ExecImage*>(image_cache.Allocate());
+    if (image == nullptr) {
+        memory_manager->Free(data, data_frames);
+        return {nullptr, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    new (image) ExecImage{};
+    image->hash = hash;
+    image->bytes = bytes;
+    image->data = data;
+    image->data_frames = data_frames;
+    image->first_page = first_page;
+    image->num_pages = num_pages;
+    image->pages = new uintptr_t[num_pages]{};
+    image->refs = 1;
+
+    SpinLockGuard guard{image_lock};
+    image->next = images;
+    images = image;
+    return {image, MAKE_ERROR(Error::kSuccess)};
+}
+
+void ReleaseExecImage(ExecImage* image) {
+    ExecImage* evicted = nullptr;
+    {
+        SpinLockGuard guard{image_lock};
+        --image->refs;
+
+        size_t idle = 0;
+        for (auto p = &images; *p != nullptr;) {
+            auto i = *p;
+            if (i->refs == 0 && ++idle > kMaxIdleImages) {
+                *p = i->next;
+                i->next = evicted;
+                evicted = i;
+            } else {
+                p = &i->next;
+            }
+        }
+    }
+
+    while (evicted) {
+        auto next = evicted->next;
+        Destroy(evicted);
+        evicted = next;
+    }
+}
+
+WithError<uintptr_t> ExecImagePage(ExecImage* image, uint64_t addr) {
+    const uint64_t page = addr & ~0xffful;
+    const size_t index = (page - image->first_page) / 4096;
+    if (page < image->first_page || index >= image->num_pages) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    SpinLockGuard guard{image->lock};
+    if (image->pages[index]) {
+        return {image->pages[index], MAKE_ERROR(Error::kSuccess)};
+    }
+
+    auto [frame, err] = memory_manager->Allocate(1);
+    if (err) {
+        return {0, err};
+    }
+    auto dst = reinterpret_cast<uint8_t*>(frame.Frame());
+    memset(dst, 0, 4096);
+
+    // segments may share a page, so every one touching it is copied
+    auto ehdr = reinterpret_cast<const Elf64_Ehdr*>(Data(image));
+    auto phdr = ProgramHeaders(Data(image));
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdr[i].p_type != PT_LOAD) continue;
+        const uint64_t start = std::max(page, phdr[i].p_vaddr);
+        const uint64_t end =
+            std::min(page + 4096, phdr[i].p_vaddr + phdr[i].p_filesz);
+        if (start < end) {
+            memcpy(dst + (start - page),
+                   Data(image) + phdr[i].p_offset + (start - phdr[i].p_vaddr),
+                   end - start);
+        }
+    }
+
+    image->pages[index] = reinterpret_cast<uintptr_t>(dst);
+    return {image->pages[index], MAKE_ERROR(Error::kSuccess)};
+}
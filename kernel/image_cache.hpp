@@ -0,0 +1,34 @@
+/**
+ * @file image_cache.hpp
+ *
+ * Executables shared by the apps that run them.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief a cached executable and the frames of its loaded pages
+ *
+ * Every app running the same file maps the same frames read-only. Pages
+ * of writable segments are copied on the first write.
+ */
+struct ExecImage;
+
+/** @brief finds the image with the same contents as file or caches a copy
+ *
+ * The caller holds a reference until ReleaseExecImage and may drop file
+ * once it has the image. A few unused images stay cached, so that running
+ * a program again reuses their frames.
+ */
+WithError<ExecImage*> AcquireExecImage(const uint8_t* file, size_t bytes);
+void ReleaseExecImage(ExecImage* image);
+/** @brief the shared frame holding the page at addr
+ *
+ * The frame is filled from the PT_LOAD segments the first time it is asked
+ * for and must not be written to.
+ */
+WithError<uintptr_t> ExecImagePage(ExecImage* image, uint64_t addr);
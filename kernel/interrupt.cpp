@@ -27,7 +27,10 @@ void NotifyEndOfInterrupt() {
 
 namespace {
 __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame* frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    {
+        SpinLockGuard guard{task_lock};
+        task_manager->PostMessage(1, Message{Message::kInterruptXHCI});
+    }
     NotifyEndOfInterrupt();
 }
 
@@ -110,6 +113,12 @@ FaultHandlerNoError(DE) FaultHandlerNoError(DB) FaultHandlerNoError(BP)
 
 }  // namespace
 
+extern "C" void RescheduleOnInterrupt(const TaskContext& ctx_stack) {
+    NotifyEndOfInterrupt();
+    task_manager->SwitchTask(ctx_stack);
+    UpdateLAPICTimer(task_manager->Idle());
+}
+
 void InitializeInterrupt() {
     auto set_idt_entry = [](int irq, auto handler) {
         SetIDTEntry(idt[irq], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
@@ -120,6 +129,10 @@ void InitializeInterrupt() {
         idt[InterruptVector::kLAPICTimer],
         MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForTimer),
         reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kReschedule],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForTimer),
+        reinterpret_cast<uint64_t>(IntHandlerReschedule), kKernelCS);
     set_idt_entry(0, IntHandlerDE);
     set_idt_entry(1, IntHandlerDB);
     set_idt_entry(3, IntHandlerBP);
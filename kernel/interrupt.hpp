@@ -56,6 +56,7 @@ class InterruptVector {
   enum Number {
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kReschedule = 0x42,
   };
 };
 
@@ -68,4 +69,20 @@ struct InterruptFrame {
 };
 
 void NotifyEndOfInterrupt();
-void InitializeInterrupt();
\ No newline at end of file
+void InitializeInterrupt();
+
+/** @brief disables interrupts in a scope and restores IF on exit */
+class InterruptGuard {
+ public:
+  InterruptGuard() {
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags_)::"memory");
+  }
+  ~InterruptGuard() {
+    if (rflags_ & 0x200) {
+      __asm__ volatile("sti" ::: "memory");
+    }
+  }
+
+ private:
+  uint64_t rflags_;
+};
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include <new>
 #include <cerrno>
+#include <cstdint>
+
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 int printk(const char* format, ...);
 
@@ -12,4 +16,41 @@ std::new_handler std::get_new_handler() noexcept {
 
 extern "C" int posix_memalign(void**, size_t, size_t) {
   return ENOMEM;
+}
+
+namespace {
+  SpinLock malloc_lock;
+  int malloc_owner = -1;
+  int malloc_depth;
+  uint64_t malloc_rflags;
+}
+
+struct _reent;
+
+// newlib's malloc calls these around every heap operation, possibly
+// recursively; the heap is shared by all CPUs
+extern "C" void __malloc_lock(struct _reent*) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+  const int cpu = CurrentCPU();
+  if (malloc_owner == cpu) {
+    ++malloc_depth;
+    return;
+  }
+  malloc_lock.Acquire();
+  malloc_owner = cpu;
+  malloc_depth = 1;
+  malloc_rflags = rflags;
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+  if (--malloc_depth > 0) {
+    return;
+  }
+  const auto rflags = malloc_rflags;
+  malloc_owner = -1;
+  malloc_lock.Release();
+  if (rflags & 0x200) {
+    __asm__ volatile("sti" ::: "memory");
+  }
 }
\ No newline at end of file
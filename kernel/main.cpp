@@ -10,6 +10,7 @@
 #include "acpi.hpp"
 #include "asmfunc.h"
 #include "font.hpp"
+#include "fpu.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 #include "interrupt.hpp"
@@ -21,6 +22,7 @@
 #include "paging.hpp"
 #include "pci.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "syscall.hpp"
 #include "system.hpp"
 #include "task.hpp"
@@ -37,28 +39,36 @@ extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref, const acpi::RSDP& acpi_table,
     void* volume_image) {
+    // both live on the loader's stack, which becomes free memory once the
+    // memory manager hands it out
+    FrameBufferConfig frame_buffer_config{frame_buffer_config_ref};
     MemoryMap memory_map{memory_map_ref};
 
     SetLogLevel(kWarn);
 
-    InitializeSegmentation();
+    InitializeSegmentation(0);
     InitializePaging();
     InitializeMemoryManager(memory_map);
-    InitializeTSS();
+    InitializeTSS(0);
     InitializeInterrupt();
+    InitializeFPU();
 
     InitializePCI();
 
     acpi::Initialize(acpi_table);
     InitializeLAPICTimer();
+#ifdef BENCH_MEMORY
+    BenchmarkMemoryManager();
+#endif
 
-    InitializeGraphics(frame_buffer_config_ref);
+    InitializeGraphics(frame_buffer_config);
     screen = new FrameBuffer;
     screen->Initialize(screen_config);
 
     InitializeSyscall();
 
     InitializeTask();
+    InitializeSMP(memory_map);
 
     Task& system_task = task_manager->CurrentTask();
     system_task.SetName("systemtask");
@@ -72,14 +82,14 @@ extern "C" void KernelMainNewStack(
     Message smsg;
 
     while (true) {
-        __asm__("cli");
+        task_lock.Lock();
         auto rmsg = system_task.ReceiveMessage();
         if (!rmsg) {
-            system_task.Sleep();
-            __asm__("sti");
+            system_task.WaitMessage();
+            task_lock.Unlock();
             continue;
         }
-        __asm__("sti");
+        task_lock.Unlock();
 
         switch (rmsg->type) {
             case Message::kInterruptXHCI:
@@ -87,23 +97,27 @@ extern "C" void KernelMainNewStack(
                 break;
 
             case Message::kExpandTaskBuffer:
-                task_manager->ExpandTaskBuffer(rmsg->arg.expand.id,
-                                               rmsg->arg.expand.bytes);
                 smsg.type = Message::kExpandTaskBuffer;
                 smsg.src_task = 1;
-                __asm__("cli");
+                task_lock.Lock();
+                task_manager->ExpandTaskBuffer(rmsg->arg.expand.id,
+                                               rmsg->arg.expand.bytes);
                 task_manager->SendMessage(rmsg->src_task, smsg);
-                __asm__("sti");
+                task_lock.Unlock();
                 break;
 
             case Message::kStartServer:
+                task_lock.Lock();
                 task_manager->StartServerTask(rmsg->arg.starttask.id,
                                               rmsg->src_task);
+                task_lock.Unlock();
                 break;
 
             case Message::kStartApp:
+                task_lock.Lock();
                 task_manager->StartAppTask(rmsg->arg.starttask.id,
                                            rmsg->src_task);
+                task_lock.Unlock();
                 printk("[ kinOS ] start task %d\n", rmsg->arg.starttask.id);
 
                 break;
@@ -1,64 +1,115 @@
 #include "memory_manager.hpp"
 
-#include <bitset>
+#include <algorithm>
+#include <cstring>
 
 #include "logger.hpp"
+#include "paging.hpp"
+
+namespace {
+int OrderOf(size_t num_frames) {
+    int order = 0;
+    while ((static_cast<size_t>(1) << order) < num_frames) {
+        ++order;
+    }
+    return order;
+}
+}  // namespace
 
 BitmapMemoryManager::BitmapMemoryManager()
     : alloc_map_{},
+      head_map_{},
+      free_lists_{},
+      free_lists_ready_{false},
+      allocated_frames_{0},
       range_begin_{FrameID{0}},
       range_end_{FrameID{kFrameCount}} {}
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-    size_t start_frame_id = range_begin_.ID();
-    while (true) {
-        size_t i = 0;
-        for (; i < num_frames; ++i) {
-            if (start_frame_id + i >= range_end_.ID()) {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
-            if (GetBit(FrameID{start_frame_id + i})) {
-                break;
-            }
-        }
-        if (i == num_frames) {
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {
-                FrameID{start_frame_id},
-                MAKE_ERROR(Error::kSuccess),
-            };
+    if (num_frames == 0) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    SpinLockGuard guard{lock_};
+    const int order = OrderOf(num_frames);
+    for (int o = order; o <= kMaxOrder; ++o) {
+        if (free_lists_[o] == nullptr) {
+            continue;
         }
-        start_frame_id += i + 1;
+
+        const size_t frame =
+            reinterpret_cast<uintptr_t>(free_lists_[o]) / kBytesPerFrame;
+        RemoveBlock(frame, o);
+        SetBits(FrameID{frame}, num_frames, true);
+        // return the unused tail (the upper halves and the remainder of the
+        // rounded-up block) to the free lists
+        InsertRange(frame + num_frames, (static_cast<size_t>(1) << o) -
+                                            num_frames, false);
+        return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    // no block is large enough, but a contiguous run spanning several
+    // blocks may still exist
+    auto [frame, err] = FindFreeRun(num_frames);
+    if (err) {
+        return {kNullFrame, err};
     }
+    CarveRange(frame, num_frames);
+    SetBits(FrameID{frame}, num_frames, true);
+    return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-    for (size_t i = 0; i < num_frames; ++i) {
-        SetBit(FrameID{start_frame.ID() + i}, false);
+    SpinLockGuard guard{lock_};
+    SetBits(start_frame, num_frames, false);
+    if (free_lists_ready_) {
+        InsertRange(start_frame.ID(), num_frames, true);
     }
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame,
                                         size_t num_frames) {
-    for (size_t i = 0; i < num_frames; ++i) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
+    SpinLockGuard guard{lock_};
+    if (free_lists_ready_) {
+        CarveRange(start_frame.ID(), num_frames);
     }
+    SetBits(start_frame, num_frames, true);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin,
                                          FrameID range_end) {
+    // free blocks hold their list nodes in the frames themselves, so only
+    // identity-mapped memory can be handed to the free lists
+    const size_t mapped_end = kPageDirectoryCount * 1_GiB / kBytesPerFrame;
+    if (range_end.ID() > mapped_end) {
+        range_end = FrameID{mapped_end};
+    }
+
+    SpinLockGuard guard{lock_};
     range_begin_ = range_begin;
     range_end_ = range_end;
+
+    free_lists_.fill(nullptr);
+    head_map_.fill(0);
+    allocated_frames_ = range_end_.ID() - range_begin_.ID();
+
+    size_t run_begin = range_begin_.ID();
+    for (size_t frame = range_begin_.ID(); frame <= range_end_.ID();
+         ++frame) {
+        if (frame < range_end_.ID() && !GetBit(FrameID{frame})) {
+            continue;
+        }
+        if (run_begin < frame) {
+            InsertRange(run_begin, frame - run_begin, false);
+        }
+        run_begin = frame + 1;
+    }
+    free_lists_ready_ = true;
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
-    size_t sum = 0;
-    for (int i = range_begin_.ID() / kBitsPerMapLine;
-         i < range_end_.ID() / kBitsPerMapLine; ++i) {
-        sum += std::bitset<kBitsPerMapLine>(alloc_map_[i]).count();
-    }
-    return {sum, range_end_.ID() - range_begin_.ID()};
+    return {allocated_frames_, range_end_.ID() - range_begin_.ID()};
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -80,6 +131,197 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
     }
 }
 
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames,
+                                  bool allocated) {
+    size_t frame = start_frame.ID();
+    const size_t end = frame + num_frames;
+    while (frame < end) {
+        const auto line_index = frame / kBitsPerMapLine;
+        const auto bit_index = frame % kBitsPerMapLine;
+        const auto bits = std::min(kBitsPerMapLine - bit_index, end - frame);
+        const MapLineType mask =
+            bits == kBitsPerMapLine
+                ? ~static_cast<MapLineType>(0)
+                : ((static_cast<MapLineType>(1) << bits) - 1) << bit_index;
+
+        if (allocated) {
+            alloc_map_[line_index] |= mask;
+        } else {
+            alloc_map_[line_index] &= ~mask;
+        }
+        frame += bits;
+    }
+}
+
+bool BitmapMemoryManager::IsBlockHead(size_t frame) const {
+    return (head_map_[frame / kBitsPerMapLine] &
+            (static_cast<MapLineType>(1) << (frame % kBitsPerMapLine))) != 0;
+}
+
+void BitmapMemoryManager::SetBlockHead(size_t frame, bool head) {
+    const auto bit = static_cast<MapLineType>(1) << (frame % kBitsPerMapLine);
+    if (head) {
+        head_map_[frame / kBitsPerMapLine] |= bit;
+    } else {
+        head_map_[frame / kBitsPerMapLine] &= ~bit;
+    }
+}
+
+void BitmapMemoryManager::PushBlock(size_t frame, int order) {
+    auto block = reinterpret_cast<FreeBlock*>(frame * kBytesPerFrame);
+    block->next = free_lists_[order];
+    block->prev = nullptr;
+    block->order = order;
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_lists_[order] = block;
+    SetBlockHead(frame, true);
+    allocated_frames_ -= static_cast<size_t>(1) << order;
+}
+
+void BitmapMemoryManager::RemoveBlock(size_t frame, int order) {
+    auto block = reinterpret_cast<FreeBlock*>(frame * kBytesPerFrame);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists_[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    SetBlockHead(frame, false);
+    allocated_frames_ += static_cast<size_t>(1) << order;
+}
+
+void BitmapMemoryManager::InsertRange(size_t frame, size_t num_frames,
+                                      bool coalesce) {
+    size_t end = frame + num_frames;
+    if (frame < range_begin_.ID()) {
+        frame = range_begin_.ID();
+    }
+    if (end > range_end_.ID()) {
+        end = range_end_.ID();
+    }
+
+    // split [frame, end) into the largest naturally aligned blocks
+    while (frame < end) {
+        int order = 0;
+        while (order < kMaxOrder &&
+               (frame & ((static_cast<size_t>(2) << order) - 1)) == 0 &&
+               frame + (static_cast<size_t>(2) << order) <= end) {
+            ++order;
+        }
+
+        if (coalesce) {
+            FreeBlockCoalesce(frame, order);
+        } else {
+            PushBlock(frame, order);
+        }
+        frame += static_cast<size_t>(1) << order;
+    }
+}
+
+void BitmapMemoryManager::FreeBlockCoalesce(size_t frame, int order) {
+    while (order < kMaxOrder) {
+        const size_t buddy = frame ^ (static_cast<size_t>(1) << order);
+        if (buddy < range_begin_.ID() || buddy >= range_end_.ID() ||
+            !IsBlockHead(buddy)) {
+            break;
+        }
+        auto block = reinterpret_cast<FreeBlock*>(buddy * kBytesPerFrame);
+        if (block->order != order) {
+            break;
+        }
+        RemoveBlock(buddy, order);
+        frame = std::min(frame, buddy);
+        ++order;
+    }
+    PushBlock(frame, order);
+}
+
+void BitmapMemoryManager::CarveRange(size_t frame, size_t num_frames) {
+    const size_t end = frame + num_frames;
+    while (frame < end) {
+        if (frame < range_begin_.ID() || frame >= range_end_.ID() ||
+            GetBit(FrameID{frame})) {
+            ++frame;
+            continue;
+        }
+
+        // a free frame always belongs to exactly one free block; find it by
+        // trying each alignment from the smallest
+        const size_t carve_begin = frame;
+        for (int order = 0; order <= kMaxOrder; ++order) {
+            const size_t head =
+                frame & ~((static_cast<size_t>(1) << order) - 1);
+            if (!IsBlockHead(head)) {
+                continue;
+            }
+            auto block = reinterpret_cast<FreeBlock*>(head * kBytesPerFrame);
+            const int block_order = block->order;
+            if (block_order < order) {
+                continue;
+            }
+
+            const size_t block_end =
+                head + (static_cast<size_t>(1) << block_order);
+            RemoveBlock(head, block_order);
+            InsertRange(head, frame - head, false);
+            if (end < block_end) {
+                InsertRange(end, block_end - end, false);
+            }
+            frame = block_end;
+            break;
+        }
+        if (frame == carve_begin) {
+            // free lists are not built yet
+            ++frame;
+        }
+    }
+}
+
+WithError<size_t> BitmapMemoryManager::FindFreeRun(size_t num_frames) const {
+    size_t run_begin = range_begin_.ID();
+    size_t run_length = 0;
+    size_t frame = range_begin_.ID();
+    while (frame < range_end_.ID()) {
+        const auto line = alloc_map_[frame / kBitsPerMapLine];
+        if (frame % kBitsPerMapLine == 0 &&
+            frame + kBitsPerMapLine <= range_end_.ID()) {
+            if (line == ~static_cast<MapLineType>(0)) {
+                run_length = 0;
+                frame += kBitsPerMapLine;
+                continue;
+            }
+            if (line == 0) {
+                if (run_length == 0) {
+                    run_begin = frame;
+                }
+                run_length += kBitsPerMapLine;
+                frame += kBitsPerMapLine;
+                if (run_length >= num_frames) {
+                    return {run_begin, MAKE_ERROR(Error::kSuccess)};
+                }
+                continue;
+            }
+        }
+
+        if (GetBit(FrameID{frame})) {
+            run_length = 0;
+        } else {
+            if (run_length == 0) {
+                run_begin = frame;
+            }
+            if (++run_length == num_frames) {
+                return {run_begin, MAKE_ERROR(Error::kSuccess)};
+            }
+        }
+        ++frame;
+    }
+    return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+}
+
 extern "C" caddr_t program_break, program_break_end;
 
 namespace {
@@ -87,11 +329,31 @@ char memory_manager_buf[sizeof(BitmapMemoryManager)];
 
 Error InitializeHeap(BitmapMemoryManager& memory_manager) {
     const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
+    const int kLargePageFrames = 512;
+    auto heap_start = memory_manager.Allocate(kHeapFrames);
     if (heap_start.error) {
         return heap_start.error;
     }
 
+    // the identity mapping uses 2 MiB pages; an aligned heap covers as few
+    // of them as possible. A buddy block is aligned, a run found by
+    // scanning the bitmap needs trimming. Without room for a larger run the
+    // unaligned heap is kept.
+    if (heap_start.value.ID() % kLargePageFrames) {
+        const size_t frames = kHeapFrames + kLargePageFrames - 1;
+        if (const auto run = memory_manager.Allocate(frames); !run.error) {
+            memory_manager.Free(heap_start.value, kHeapFrames);
+            const size_t head = (kLargePageFrames -
+                                 run.value.ID() % kLargePageFrames) %
+                                kLargePageFrames;
+            memory_manager.Free(run.value, head);
+            memory_manager.Free(
+                FrameID{run.value.ID() + head + kHeapFrames},
+                frames - head - kHeapFrames);
+            heap_start.value = FrameID{run.value.ID() + head};
+        }
+    }
+
     program_break =
         reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
     program_break_end = program_break + kHeapFrames * kBytesPerFrame;
@@ -126,7 +388,9 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
                 desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
         }
     }
-    memory_manager->SetMemoryRange(FrameID{1},
+    // memory below 1 MiB is left alone so that the startup code of the
+    // application processors can be placed there
+    memory_manager->SetMemoryRange(FrameID{1_MiB / kBytesPerFrame},
                                    FrameID{available_end / kBytesPerFrame});
 
     if (auto err = InitializeHeap(*memory_manager)) {
@@ -134,4 +398,156 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
             err.File(), err.Line());
         exit(1);
     }
-}
\ No newline at end of file
+}
+
+namespace {
+const size_t kZeroedPoolFrames = 64;
+
+std::array<size_t, kZeroedPoolFrames> zeroed_frames;
+size_t zeroed_count = 0;
+SpinLock zeroed_lock;
+}  // namespace
+
+WithError<FrameID> AllocateZeroedFrame() {
+    {
+        SpinLockGuard guard{zeroed_lock};
+        if (zeroed_count > 0) {
+            return {FrameID{zeroed_frames[--zeroed_count]},
+                    MAKE_ERROR(Error::kSuccess)};
+        }
+    }
+
+    auto frame = memory_manager->Allocate(1);
+    if (!frame.error) {
+        memset(frame.value.Frame(), 0, kBytesPerFrame);
+    }
+    return frame;
+}
+
+bool RefillZeroedFrames() {
+    {
+        SpinLockGuard guard{zeroed_lock};
+        if (zeroed_count == kZeroedPoolFrames) {
+            return false;
+        }
+    }
+
+    auto [frame, err] = memory_manager->Allocate(1);
+    if (err) {
+        return false;
+    }
+    memset(frame.Frame(), 0, kBytesPerFrame);
+
+    {
+        SpinLockGuard guard{zeroed_lock};
+        if (zeroed_count < kZeroedPoolFrames) {
+            zeroed_frames[zeroed_count++] = frame.ID();
+            return true;
+        }
+    }
+    // another CPU filled the pool meanwhile
+    memory_manager->Free(frame, 1);
+    return false;
+}
+
+#ifdef BENCH_MEMORY
+namespace {
+const size_t kBenchUsed = 16384;  // frames in use before the first hole
+const size_t kBenchHoles = 4096;  // free single frames between used ones
+const size_t kBenchRounds = 256;
+
+// the frame allocator this one replaced: a first-fit scan of the bitmap,
+// one bit at a time
+class LinearScanAllocator {
+   public:
+    static const size_t kFrames = kBenchUsed + 2 * kBenchHoles + 1024;
+
+    bool Get(size_t frame) const {
+        return (map_[frame / 64] >> (frame % 64)) & 1;
+    }
+    void Set(size_t frame, size_t num_frames, bool allocated) {
+        for (size_t i = frame; i < frame + num_frames; ++i) {
+            if (allocated) {
+                map_[i / 64] |= 1ul << (i % 64);
+            } else {
+                map_[i / 64] &= ~(1ul << (i % 64));
+            }
+        }
+    }
+    size_t Allocate(size_t num_frames) {
+        size_t start = 0;
+        while (start + num_frames <= kFrames) {
+            size_t i = 0;
+            while (i < num_frames && !Get(start + i)) {
+                ++i;
+            }
+            if (i == num_frames) {
+                Set(start, num_frames, true);
+                return start;
+            }
+            start += i + 1;
+        }
+        return kFrames;
+    }
+
+   private:
+    std::array<uint64_t, (kFrames + 63) / 64> map_{};
+};
+
+LinearScanAllocator linear_scan;
+std::array<size_t, 2 * kBenchHoles> bench_frames;
+
+template <class F>
+uint64_t CyclesPerRound(F round) {
+    const uint64_t start = __builtin_ia32_rdtsc();
+    for (size_t i = 0; i < kBenchRounds; ++i) {
+        round();
+    }
+    return (__builtin_ia32_rdtsc() - start) / kBenchRounds;
+}
+}  // namespace
+
+void BenchmarkMemoryManager() {
+    // leave kBenchHoles isolated free frames behind in both allocators
+    size_t held = 0;
+    for (; held < bench_frames.size(); ++held) {
+        auto [frame, err] = memory_manager->Allocate(1);
+        if (err) {
+            break;
+        }
+        bench_frames[held] = frame.ID();
+    }
+    for (size_t i = 0; i < held; i += 2) {
+        memory_manager->Free(FrameID{bench_frames[i]}, 1);
+    }
+    // the scan starts at the lowest frame every time, so memory in use
+    // below the holes costs it too
+    linear_scan.Set(0, LinearScanAllocator::kFrames, false);
+    linear_scan.Set(0, kBenchUsed, true);
+    for (size_t i = 0; i < 2 * kBenchHoles; i += 2) {
+        linear_scan.Set(kBenchUsed + i + 1, 1, true);
+    }
+
+    for (size_t n : {1, 8, 64}) {
+        const auto buddy = CyclesPerRound([n] {
+            if (auto [frame, err] = memory_manager->Allocate(n); !err) {
+                memory_manager->Free(frame, n);
+            }
+        });
+        const auto linear = CyclesPerRound([n] {
+            const auto frame = linear_scan.Allocate(n);
+            if (frame < LinearScanAllocator::kFrames) {
+                linear_scan.Set(frame, n, false);
+            }
+        });
+        Log(kWarn,
+            "frame allocator, %lu frames with %lu holes: buddy %lu cycles, "
+            "linear scan %lu cycles\n",
+            n, kBenchHoles, buddy, linear);
+    }
+
+    for (size_t i = 1; i < held; i += 2) {
+        memory_manager->Free(FrameID{bench_frames[i]}, 1);
+    }
+}
+#endif
@@ -5,6 +5,7 @@
 
 #include "error.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace {
 constexpr unsigned long long operator""_KiB(unsigned long long kib) {
@@ -41,6 +42,12 @@ struct MemoryStat {
     size_t total_frames;
 };
 
+/** @brief physical frame allocator
+ *
+ * The bitmap records which frames are in use. Free frames are additionally
+ * kept as power-of-two blocks on per-order free lists (buddy allocator), so
+ * Allocate and Free do not depend on how full or fragmented memory is.
+ */
 class BitmapMemoryManager {
    public:
     static const auto kMaxPhysicalMemoryBytes{128_GiB};
@@ -49,24 +56,69 @@ class BitmapMemoryManager {
     using MapLineType = unsigned long;
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
+    /** @brief largest block order (2^kMaxOrder frames = 128 MiB) */
+    static const int kMaxOrder{15};
+
     BitmapMemoryManager();
 
     WithError<FrameID> Allocate(size_t num_frames);
     Error Free(FrameID start_frame, size_t num_frames);
     void MarkAllocated(FrameID start_frame, size_t num_frames);
 
+    /** @brief set managed range and build free lists from unused frames */
     void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
     MemoryStat Stat() const;
 
    private:
+    // stored in the first frame of each free block
+    struct FreeBlock {
+        FreeBlock* next;
+        FreeBlock* prev;
+        int order;
+    };
+
     std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    // set only for the first frame of each free block
+    std::array<MapLineType, kFrameCount / kBitsPerMapLine> head_map_;
+    std::array<FreeBlock*, kMaxOrder + 1> free_lists_;
+    bool free_lists_ready_;
+    size_t allocated_frames_;
     FrameID range_begin_;
     FrameID range_end_;
+    SpinLock lock_;
 
     bool GetBit(FrameID frame) const;
     void SetBit(FrameID frame, bool allocated);
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
+    bool IsBlockHead(size_t frame) const;
+    void SetBlockHead(size_t frame, bool head);
+
+    void PushBlock(size_t frame, int order);
+    void RemoveBlock(size_t frame, int order);
+    void InsertRange(size_t frame, size_t num_frames, bool coalesce);
+    void FreeBlockCoalesce(size_t frame, int order);
+    void CarveRange(size_t frame, size_t num_frames);
+    WithError<size_t> FindFreeRun(size_t num_frames) const;
 };
 
 extern BitmapMemoryManager* memory_manager;
-void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
+void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/** @brief a zero-filled frame, taken from the pool if it has one */
+WithError<FrameID> AllocateZeroedFrame();
+/** @brief zeroes one more frame for the pool; false once it is full
+ *
+ * The idle tasks call this, so that page faults rarely wait for memset.
+ */
+bool RefillZeroedFrames();
+
+#ifdef BENCH_MEMORY
+/** @brief logs the cost of Allocate and Free on fragmented memory
+ *
+ * The numbers are compared with the first-fit bitmap scan the buddy
+ * allocator replaced. Only built with BENCH_MEMORY. The TSC counts the
+ * cycles, so call this only after InitializeLAPICTimer.
+ */
+void BenchmarkMemoryManager();
+#endif
\ No newline at end of file
@@ -5,4 +5,5 @@
 static constexpr uint32_t kIA32_EFER  = 0xc0000080;
 static constexpr uint32_t kIA32_STAR  = 0xc0000081;
 static constexpr uint32_t kIA32_LSTAR = 0xc0000082;
-static constexpr uint32_t kIA32_FMASK = 0xc0000084;
\ No newline at end of file
+static constexpr uint32_t kIA32_FMASK = 0xc0000084;
+static constexpr uint32_t kIA32_KERNEL_GS_BASE = 0xc0000102;
\ No newline at end of file
@@ -1,21 +1,75 @@
 #include "paging.hpp"
 
+#include <cpuid.h>
+
+#include <algorithm>
 #include <array>
 
 #include "asmfunc.h"
+#include "image_cache.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 #include "task.hpp"
+#include "timer.hpp"
 
 namespace {
 const uint64_t kPageSize4K = 4096;
 const uint64_t kPageSize2M = 512 * kPageSize4K;
 const uint64_t kPageSize1G = 512 * kPageSize2M;
+const uint64_t kUserSpaceBegin = 0xffff'8000'0000'0000;
 
 alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
 alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
 alignas(kPageSize4K)
     std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+alignas(kPageSize4K) const std::array<uint8_t, kPageSize4K> zero_page{};
+
+// a write fault in the demand paging area maps this many pages around it
+const uint64_t kFaultAroundPages = 16;
+PageFaultStat fault_stat{};
+
+const uint64_t kCR4PGE = 1u << 7;
+const uint64_t kCR4PCIDE = 1u << 17;
+const uint64_t kCR3NoFlush = 1ul << 63;
+const uint64_t kPCIDMask = 0xfff;
+const int kPCIDCount = 4096;
+// shared by address spaces created while every other PCID is in use;
+// loading it always flushes
+const uint64_t kUntaggedPCID = kPCIDCount - 1;
+
+bool pcid_enabled;
+SpinLock pcid_lock;
+std::array<uint64_t, kPCIDCount / 64> pcid_used{1};  // 0 is the kernel's
+// CPUs which may still hold TLB entries that are no longer valid
+std::array<uint32_t, kPCIDCount> stale_cpus{};
+
+uint32_t AllCPUs() { return (1u << kMaxCPUs) - 1; }
+
+uint64_t AllocatePCID() {
+    SpinLockGuard guard{pcid_lock};
+    for (uint64_t pcid = 1; pcid < kUntaggedPCID; ++pcid) {
+        if ((pcid_used[pcid / 64] & (1ul << (pcid % 64))) == 0) {
+            pcid_used[pcid / 64] |= 1ul << (pcid % 64);
+            return pcid;
+        }
+    }
+    return kUntaggedPCID;
+}
+
+// invalidates the pages here and makes other CPUs flush the current PCID
+// before they use it again
+void InvalidatePages(uint64_t addr, size_t num_4kpages) {
+    for (size_t i = 0; i < num_4kpages; ++i) {
+        InvalidateTLB(addr + i * kPageSize4K);
+    }
+    const auto others = AllCPUs() & ~(1u << CurrentCPU());
+    __atomic_fetch_or(&stale_cpus[GetCR3() & kPCIDMask], others,
+                      __ATOMIC_RELAXED);
+}
+
+void InvalidatePage(uint64_t addr) { InvalidatePages(addr, 1); }
 }  // namespace
 
 void SetupIdentityPageTable() {
@@ -25,21 +79,114 @@ void SetupIdentityPageTable() {
             reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
         for (int i_pd = 0; i_pd < 512; ++i_pd) {
             page_directory[i_pdpt][i_pd] =
-                i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+                i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
         }
     }
 
     ResetCR3();
-    SetCR0(GetCR0() & 0xfffeffff);
+    // kernel writes to read-only app pages fault and get copied, so that
+    // pages shared through the image cache stay intact
+    SetCR0(GetCR0() | 0x10000);
+}
+
+void InitializePaging() {
+    SetupIdentityPageTable();
+    InitializePCID();
+}
+
+void InitializePCID() {
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);  // ECX bit 17: PCID
+    uint64_t cr4 = GetCR4() | kCR4PGE;
+    // PCIDE can only be set while CR3 holds PCID 0
+    if ((ecx & (1u << 17)) && (GetCR3() & kPCIDMask) == 0) {
+        cr4 |= kCR4PCIDE;
+        pcid_enabled = true;
+    }
+    SetCR4(cr4);
+}
+
+void ResetCR3() {
+    SwitchAddressSpace(reinterpret_cast<uint64_t>(&pml4_table[0]));
 }
 
-void InitializePaging() { SetupIdentityPageTable(); }
+PageMapEntry* CurrentPML4() { return PML4OfCR3(GetCR3()); }
 
-void ResetCR3() { SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0])); }
+uint64_t NewAddressSpace(PageMapEntry* pml4) {
+    const auto cr3 = reinterpret_cast<uint64_t>(pml4);
+    if (!pcid_enabled) {
+        return cr3;
+    }
+    // the PCID may have been used by an address space that is gone
+    const auto pcid = AllocatePCID();
+    __atomic_store_n(&stale_cpus[pcid], AllCPUs(), __ATOMIC_RELAXED);
+    return cr3 | pcid;
+}
+
+void ReleaseAddressSpace(uint64_t cr3) {
+    const auto pcid = cr3 & kPCIDMask;
+    if (pcid == 0 || pcid == kUntaggedPCID) {
+        return;
+    }
+    SpinLockGuard guard{pcid_lock};
+    pcid_used[pcid / 64] &= ~(1ul << (pcid % 64));
+}
+
+extern "C" void SwitchAddressSpace(uint64_t cr3) {
+    if (cr3 == GetCR3()) {
+        return;
+    }
+    const auto pcid = cr3 & kPCIDMask;
+    if (pcid_enabled && pcid != kUntaggedPCID) {
+        const auto cpu_bit = 1u << CurrentCPU();
+        const auto stale =
+            __atomic_fetch_and(&stale_cpus[pcid], ~cpu_bit, __ATOMIC_RELAXED);
+        if ((stale & cpu_bit) == 0) {
+            cr3 |= kCR3NoFlush;
+        }
+    }
+    SetCR3(cr3);
+}
 
 namespace {
 
-WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+// replaces the 2 MiB page mapped at addr with a page table mapping the
+// same frames
+Error SplitLargePage(PageMapEntry& entry, uint64_t addr) {
+    auto [table, err] = NewPageMap();
+    if (err) {
+        return err;
+    }
+    const auto base = reinterpret_cast<uintptr_t>(entry.Pointer());
+    for (int i = 0; i < 512; ++i) {
+        table[i].SetPointer(
+            reinterpret_cast<PageMapEntry*>(base + i * kPageSize4K));
+        table[i].bits.present = 1;
+        table[i].bits.writable = entry.bits.writable;
+        table[i].bits.user = entry.bits.user;
+    }
+
+    // other CPUs may walk the tables meanwhile, so they must never see a
+    // half-built entry
+    PageMapEntry split{0};
+    split.SetPointer(table);
+    split.bits.present = 1;
+    split.bits.writable = 1;
+    split.bits.user = entry.bits.user;
+    __atomic_store_n(&entry.data, split.data, __ATOMIC_RELEASE);
+    // the page size changed, so the old 2 MiB translation has to go
+    InvalidatePages(addr & ~(kPageSize2M - 1), kPageSize2M / kPageSize4K);
+    __atomic_fetch_add(&fault_stat.large_splits, 1, __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry,
+                                                   uint64_t addr) {
+    if (entry.bits.present && entry.bits.huge_page) {
+        if (auto err = SplitLargePage(entry, addr)) {
+            return {nullptr, err};
+        }
+    }
     if (entry.bits.present) {
         return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
     }
@@ -62,7 +209,7 @@ WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level,
         const auto entry_index = addr.Part(page_map_level);
 
         auto [child_map, err] =
-            SetNewPageMapIfNotPresent(page_map[entry_index]);
+            SetNewPageMapIfNotPresent(page_map[entry_index], addr.value);
         if (err) {
             return {num_4kpages, err};
         }
@@ -103,18 +250,20 @@ Error CleanPageMap(PageMapEntry* page_map, int page_map_level,
             continue;
         }
 
-        if (page_map_level > 1) {
+        if (page_map_level > 1 && !entry.bits.huge_page) {
             if (auto err =
                     CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
                 return err;
             }
         }
 
-        if (entry.bits.writable) {
+        if (!entry.bits.shared && !entry.bits.cached && !entry.bits.zero) {
             const auto entry_addr =
                 reinterpret_cast<uintptr_t>(entry.Pointer());
             const FrameID map_frame{entry_addr / kBytesPerFrame};
-            if (auto err = memory_manager->Free(map_frame, 1)) {
+            const size_t frames =
+                page_map_level == 2 && entry.bits.huge_page ? 512 : 1;
+            if (auto err = memory_manager->Free(map_frame, frames)) {
                 return err;
             }
         }
@@ -129,38 +278,248 @@ Error SetPageContent(PageMapEntry* table, int part, LinearAddress4Level addr,
                      PageMapEntry* content) {
     if (part == 1) {
         const auto i = addr.Part(part);
+        // unless it is the zero page or belongs to the image cache, the old
+        // frame is a private read-only page of this address space
+        const auto old_entry = table[i];
         table[i].SetPointer(content);
         table[i].bits.writable = 1;
-        InvalidateTLB(addr.value);
-        return MAKE_ERROR(Error::kSuccess);
+        table[i].bits.cached = 0;
+        table[i].bits.zero = 0;
+        InvalidatePage(addr.value);
+        if (old_entry.bits.cached || old_entry.bits.zero) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        const FrameID old_frame{
+            reinterpret_cast<uintptr_t>(old_entry.Pointer()) / kBytesPerFrame};
+        return memory_manager->Free(old_frame, 1);
     }
 
     const auto i = addr.Part(part);
     return SetPageContent(table[i].Pointer(), part - 1, addr, content);
 }
 
+// the entry at the given level for addr in the current address space,
+// creating the tables above it
+WithError<PageMapEntry*> EntryAt(LinearAddress4Level addr,
+                                 int page_map_level) {
+    PageMapEntry* table = CurrentPML4();
+    for (int level = 4; level > page_map_level; --level) {
+        auto& entry = table[addr.Part(level)];
+        auto [child_map, err] = SetNewPageMapIfNotPresent(entry, addr.value);
+        if (err) {
+            return {nullptr, err};
+        }
+        entry.bits.user = 1;
+        entry.bits.writable = 1;
+        table = child_map;
+    }
+    return {&table[addr.Part(page_map_level)], MAKE_ERROR(Error::kSuccess)};
+}
+
+WithError<PageMapEntry*> LeafEntry(LinearAddress4Level addr) {
+    return EntryAt(addr, 1);
+}
+
+// maps a zero-filled 2 MiB page at addr unless part of it is mapped already
+Error MapLargePage(uint64_t addr) {
+    auto [entry, err] = EntryAt(LinearAddress4Level{addr}, 2);
+    if (err) {
+        return err;
+    }
+    if (entry->bits.present) {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+
+    const size_t frames = kPageSize2M / kBytesPerFrame;
+    auto [frame, err_frame] = memory_manager->Allocate(frames);
+    if (err_frame) {
+        return err_frame;
+    }
+    // only blocks from the buddy free lists are naturally aligned
+    if (frame.ID() % frames) {
+        memory_manager->Free(frame, frames);
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    memset(frame.Frame(), 0, kPageSize2M);
+
+    PageMapEntry large{0};
+    large.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+    large.bits.present = 1;
+    large.bits.writable = 1;
+    large.bits.user = 1;
+    large.bits.huge_page = 1;
+    __atomic_store_n(&entry->data, large.data, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&fault_stat.large_pages, 1, __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 Error CopyOnePage(uint64_t causal_addr) {
+    const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
+    auto [entry, err_entry] = LeafEntry(LinearAddress4Level{aligned_addr});
+    if (err_entry) {
+        return err_entry;
+    }
     auto [p, err] = NewPageMap();
     if (err) {
         return err;
     }
-    const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-    memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-    return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
+    // the new frame is already zeroed
+    if (!entry->bits.zero) {
+        memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
+    }
+    return SetPageContent(CurrentPML4(), 4,
                           LinearAddress4Level{causal_addr}, p);
 }
 
+// maps a frame the address space does not own; a write copies it
+WithError<PageMapEntry*> MapReadOnly(uint64_t addr, uintptr_t frame) {
+    auto [entry, err] = LeafEntry(LinearAddress4Level{addr});
+    if (err) {
+        return {nullptr, err};
+    }
+    entry->data = 0;
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+    entry->bits.present = 1;
+    entry->bits.user = 1;
+    return {entry, MAKE_ERROR(Error::kSuccess)};
+}
+
+// reads of untouched memory see the zero page until the first write
+Error MapZeroPage(uint64_t addr) {
+    auto [entry, err] =
+        MapReadOnly(addr, reinterpret_cast<uintptr_t>(zero_page.data()));
+    if (err) {
+        return err;
+    }
+    entry->bits.zero = 1;
+    __atomic_fetch_add(&fault_stat.zero_maps, 1, __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapFilePage(const Task& task, uint64_t causal_addr, bool write) {
+    const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+    const uint64_t page_end = page + kPageSize4K;
+    const uint64_t large = page & ~(kPageSize2M - 1);
+
+    bool found = false;
+    bool writable = false;
+    bool from_file = false;
+    bool large_bss = false;
+    for (size_t i = 0; i < task.FileMappingCount(); ++i) {
+        const auto& m = task.GetFileMapping(i);
+        if (m.begin < page_end && page < m.end) {
+            found = true;
+            writable |= m.writable;
+            from_file |= page < m.file_end;
+            large_bss |= m.writable && m.file_end <= large &&
+                         large + kPageSize2M <= m.end;
+        }
+    }
+    if (!found) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (!from_file) {
+        // only bss
+        if (!write) {
+            return MapZeroPage(page);
+        }
+        if (large_bss && !MapLargePage(large)) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        return SetupPageMaps(LinearAddress4Level{page}, 1, writable);
+    }
+
+    // shared with every app running the image, hence read-only even in
+    // writable segments; a write makes a private copy
+    auto [frame, err] = ExecImagePage(task.Image(), page);
+    if (err) {
+        return err;
+    }
+    auto [entry, err_entry] = MapReadOnly(page, frame);
+    if (err_entry) {
+        return err_entry;
+    }
+    entry->bits.cached = 1;
+    __atomic_fetch_add(&fault_stat.file_pages, 1, __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+// maps the 2 MiB page or else the aligned cluster of demand paging pages
+// around causal_addr
+Error MapDemandPages(const Task& task, uint64_t causal_addr) {
+    const uint64_t large = causal_addr & ~(kPageSize2M - 1);
+    if (task.DPagingBegin() <= large &&
+        large + kPageSize2M <= task.DPagingEnd() && !MapLargePage(large)) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const uint64_t page = causal_addr & ~(kPageSize4K - 1);
+    const uint64_t cluster_bytes = kFaultAroundPages * kPageSize4K;
+    const uint64_t cluster = page & ~(cluster_bytes - 1);
+    const uint64_t begin = std::max(cluster, task.DPagingBegin());
+    const uint64_t end = std::min(cluster + cluster_bytes, task.DPagingEnd());
+
+    // the cluster lies in one page table, so a single walk serves it
+    auto [entries, err] = LeafEntry(LinearAddress4Level{begin});
+    if (err) {
+        return err;
+    }
+    uint64_t mapped = 0;
+    for (uint64_t addr = begin; addr < end; addr += kPageSize4K) {
+        auto& entry = entries[(addr - begin) / kPageSize4K];
+        if (entry.bits.present) {
+            continue;
+        }
+        auto [frame, err] = AllocateZeroedFrame();
+        if (err) {
+            if (addr == page) {
+                return err;
+            }
+            continue;
+        }
+        entry.data = 0;
+        entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+        entry.bits.present = 1;
+        entry.bits.writable = 1;
+        entry.bits.user = 1;
+        ++mapped;
+    }
+    __atomic_fetch_add(&fault_stat.demand_pages, mapped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fault_stat.around_pages, mapped ? mapped - 1 : 0,
+                       __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error ResolvePageFault(uint64_t error_code, uint64_t causal_addr) {
+    auto& task = task_manager->CurrentTask();
+    const bool present = (error_code >> 0) & 1;
+    const bool rw = (error_code >> 1) & 1;
+    if (present && rw && causal_addr >= kUserSpaceBegin) {
+        __atomic_fetch_add(&fault_stat.copies, 1, __ATOMIC_RELAXED);
+        return CopyOnePage(causal_addr);
+    } else if (present) {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+
+    if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
+        if (rw) {
+            return MapDemandPages(task, causal_addr);
+        }
+        return MapZeroPage(causal_addr);
+    }
+
+    return MapFilePage(task, causal_addr, rw);
+}
+
 }  // namespace
 
 WithError<PageMapEntry*> NewPageMap() {
-    auto frame = memory_manager->Allocate(1);
+    auto frame = AllocateZeroedFrame();
     if (frame.error) {
         return {nullptr, frame.error};
     }
-
-    auto e = reinterpret_cast<PageMapEntry*>(frame.value.Frame());
-    memset(e, 0, sizeof(uint64_t) * 512);
-    return {e, MAKE_ERROR(Error::kSuccess)};
+    return {reinterpret_cast<PageMapEntry*>(frame.value.Frame()),
+            MAKE_ERROR(Error::kSuccess)};
 }
 
 Error FreePageMap(PageMapEntry* table) {
@@ -170,58 +529,188 @@ Error FreePageMap(PageMapEntry* table) {
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    auto pml4_table = CurrentPML4();
     return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
 Error CleanPageMaps(LinearAddress4Level addr) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    auto pml4_table = CurrentPML4();
     return CleanPageMap(pml4_table, 4, addr);
 }
 
-Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
-    if (part == 1) {
-        for (int i = start; i < 512; ++i) {
-            if (!src[i].bits.present) {
-                continue;
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+    auto pml4_table = CurrentPML4();
+    const uint64_t end = addr.value + num_4kpages * kPageSize4K;
+    uint64_t page = addr.value & ~(kPageSize4K - 1);
+    while (page < end) {
+        const LinearAddress4Level laddr{page};
+        PageMapEntry* table = pml4_table;
+        int level = 4;
+        while (level > 1 && table[laddr.Part(level)].bits.present &&
+               !table[laddr.Part(level)].bits.huge_page) {
+            table = table[laddr.Part(level)].Pointer();
+            --level;
+        }
+        auto& entry = table[laddr.Part(level)];
+        const uint64_t entry_bytes = kPageSize4K << (9 * (level - 1));
+        const uint64_t entry_begin = page & ~(entry_bytes - 1);
+
+        if (entry.bits.present && level == 2 &&
+            (entry_begin < page || end < entry_begin + entry_bytes)) {
+            // only part of the 2 MiB page goes away
+            if (auto err = SplitLargePage(entry, entry_begin)) {
+                return err;
             }
-            dest[i] = src[i];
-            dest[i].bits.writable = 0;
+            continue;
+        }
+        if (entry.bits.present) {
+            if (!entry.bits.shared && !entry.bits.cached && !entry.bits.zero) {
+                const FrameID frame{
+                    reinterpret_cast<uintptr_t>(entry.Pointer()) /
+                    kBytesPerFrame};
+                if (auto err = memory_manager->Free(
+                        frame, entry_bytes / kBytesPerFrame)) {
+                    return err;
+                }
+            }
+            entry.data = 0;
+            InvalidatePage(page);
         }
-        return MAKE_ERROR(Error::kSuccess);
-    }
 
-    for (int i = start; i < 512; ++i) {
-        if (!src[i].bits.present) {
-            continue;
+        const uint64_t next = entry_begin + entry_bytes;
+        if (next <= page) {
+            break;  // the end of the address space
         }
-        auto [table, err] = NewPageMap();
+        page = next;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error SetupSharedPageMaps(LinearAddress4Level addr, size_t num_4kpages,
+                          uintptr_t phys_addr) {
+    for (size_t i = 0; i < num_4kpages; ++i) {
+        auto [entry, err] =
+            LeafEntry(LinearAddress4Level{addr.value + i * kPageSize4K});
         if (err) {
             return err;
         }
-        dest[i] = src[i];
-        dest[i].SetPointer(table);
-        if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0)) {
-            return err;
-        }
+        entry->data = 0;
+        entry->SetPointer(
+            reinterpret_cast<PageMapEntry*>(phys_addr + i * kPageSize4K));
+        entry->bits.present = 1;
+        entry->bits.writable = 1;
+        entry->bits.user = 1;
+        entry->bits.shared = 1;
     }
     return MAKE_ERROR(Error::kSuccess);
 }
 
+void CleanSharedPageMaps(LinearAddress4Level addr, size_t num_4kpages) {
+    auto pml4_table = CurrentPML4();
+    for (size_t i = 0; i < num_4kpages; ++i) {
+        LinearAddress4Level page{addr.value + i * kPageSize4K};
+        PageMapEntry* table = pml4_table;
+        for (int level = 4; level > 1 && table; --level) {
+            const auto entry = table[page.Part(level)];
+            table = entry.bits.present && !entry.bits.huge_page
+                        ? entry.Pointer()
+                        : nullptr;
+        }
+        if (table && table[page.Part(1)].bits.shared) {
+            table[page.Part(1)].data = 0;
+            InvalidatePage(page.value);
+        }
+    }
+}
+
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
-    auto& task = task_manager->CurrentTask();
-    const bool present = (error_code >> 0) & 1;
-    const bool rw = (error_code >> 1) & 1;
-    const bool user = (error_code >> 2) & 1;
-    if (present && rw && user) {
-        return CopyOnePage(causal_addr);
-    } else if (present) {
-        return MAKE_ERROR(Error::kAlreadyAllocated);
+    const uint64_t start = CurrentTimeNs();
+    auto err = ResolvePageFault(error_code, causal_addr);
+    __atomic_fetch_add(&fault_stat.faults, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fault_stat.fault_ns, CurrentTimeNs() - start,
+                       __ATOMIC_RELAXED);
+    return err;
+}
+
+Error PopulateDemandPages(LinearAddress4Level addr, size_t num_4kpages) {
+    const uint64_t end = addr.value + num_4kpages * kPageSize4K;
+    for (uint64_t page = addr.value; page < end;) {
+        if (page % kPageSize2M == 0 && page + kPageSize2M <= end &&
+            !MapLargePage(page)) {
+            page += kPageSize2M;
+            continue;
+        }
+        const uint64_t next =
+            std::min(end, (page + kPageSize2M) & ~(kPageSize2M - 1));
+        if (auto err = SetupPageMaps(LinearAddress4Level{page},
+                                     (next - page) / kPageSize4K)) {
+            return err;
+        }
+        page = next;
     }
+    __atomic_fetch_add(&fault_stat.populated_pages, num_4kpages,
+                       __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kSuccess);
+}
 
-    if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-        return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+PageFaultStat GetPageFaultStat() {
+    // the counters are only statistics, so a plain copy is enough even if
+    // another CPU bumps one of them meanwhile
+    return fault_stat;
+}
+
+WithError<uintptr_t> GetPhysicalAddress(PageMapEntry* pml4, uint64_t addr,
+                                        bool writable) {
+    const LinearAddress4Level laddr{addr};
+    PageMapEntry* table = pml4;
+    for (int level = 4; level >= 1; --level) {
+        const auto entry = table[laddr.Part(level)];
+        if (!entry.bits.present || (writable && !entry.bits.writable)) {
+            return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        if (level == 1 || (level == 2 && entry.bits.huge_page)) {
+            const uint64_t page_size = level == 1 ? kPageSize4K : kPageSize2M;
+            const auto base = reinterpret_cast<uintptr_t>(entry.Pointer()) &
+                              ~(page_size - 1);
+            return {base + (addr & (page_size - 1)),
+                    MAKE_ERROR(Error::kSuccess)};
+        }
+        table = entry.Pointer();
     }
+    return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+}
 
-    return MAKE_ERROR(Error::kIndexOutOfRange);
+Error PreparePageMaps(LinearAddress4Level addr, size_t num_4kpages,
+                      bool writable) {
+    auto pml4 = CurrentPML4();
+    for (size_t i = 0; i < num_4kpages; ++i) {
+        const uint64_t page =
+            (addr.value & ~(kPageSize4K - 1)) + i * kPageSize4K;
+        auto [phys, err] = GetPhysicalAddress(pml4, page);
+        if (err) {
+            // not present: only the demand paging area and the executable
+            // can be filled in. A write fault keeps untouched memory off
+            // the zero page.
+            if (auto err = ResolvePageFault(writable ? 2 : 0, page)) {
+                return err;
+            }
+        }
+        if (!writable) {
+            continue;
+        }
+
+        // read-only pages such as those mapped from the image cache get a
+        // private copy before the grantee may write to them
+        LinearAddress4Level laddr{page};
+        PageMapEntry* entry = &pml4[laddr.Part(4)];
+        for (int level = 3; level >= 1 && !entry->bits.huge_page; --level) {
+            entry = &entry->Pointer()[laddr.Part(level)];
+        }
+        if (!entry->bits.writable) {
+            if (auto err = CopyOnePage(page)) {
+                return err;
+            }
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
 }
\ No newline at end of file
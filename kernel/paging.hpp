@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "../libs/common/stat.hpp"
 #include "error.hpp"
 
 const size_t kPageDirectoryCount = 64;
@@ -10,6 +11,8 @@ const size_t kPageDirectoryCount = 64;
 void SetupIdentityPageTable();
 
 void InitializePaging();
+/** @brief enables global pages and, if available, PCIDs on this CPU */
+void InitializePCID();
 void ResetCR3();
 
 union LinearAddress4Level {
@@ -75,7 +78,9 @@ union PageMapEntry {
         uint64_t dirty : 1;
         uint64_t huge_page : 1;
         uint64_t global : 1;
-        uint64_t : 3;
+        uint64_t shared : 1;  // frame belongs to a shared region
+        uint64_t cached : 1;  // frame belongs to the executable image cache
+        uint64_t zero : 1;    // the shared zero page
 
         uint64_t addr : 40;
         uint64_t : 12;
@@ -90,10 +95,72 @@ union PageMapEntry {
     }
 };
 
+/** @brief the PML4 of a CR3 value, without the PCID in the low bits */
+inline PageMapEntry* PML4OfCR3(uint64_t cr3) {
+    return reinterpret_cast<PageMapEntry*>(cr3 & ~0xffful);
+}
+PageMapEntry* CurrentPML4();
+
+/** @brief gives pml4 a PCID and returns the CR3 value to load it with */
+uint64_t NewAddressSpace(PageMapEntry* pml4);
+/** @brief returns the PCID of an address space that is no longer used */
+void ReleaseAddressSpace(uint64_t cr3);
+/** @brief loads cr3, flushing its TLB entries only when they may be stale
+ *
+ * Does nothing if cr3 is already loaded.
+ */
+extern "C" void SwitchAddressSpace(uint64_t cr3);
+
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
-Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
+/** @brief unmaps the pages and frees the frames the address space owns
+ *
+ * A 2 MiB page that is only partly in the range is split first. The page
+ * tables stay until CleanPageMaps.
+ */
+Error UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+/** @brief maps the given physical pages, e.g. of a shared region
+ *
+ * The entries are marked shared so that CleanPageMaps leaves the frames
+ * to their owner.
+ */
+Error SetupSharedPageMaps(LinearAddress4Level addr, size_t num_4kpages,
+                          uintptr_t phys_addr);
+/** @brief removes mappings made by SetupSharedPageMaps */
+void CleanSharedPageMaps(LinearAddress4Level addr, size_t num_4kpages);
+
+/** @brief part of an app that is read from its executable on first touch
+ *
+ * [begin, file_end) comes from the file through the image cache of the
+ * task and [file_end, end) is zero-filled.
+ */
+struct FileMapping {
+    uint64_t begin, end;
+    uint64_t file_end;
+    bool writable;
+};
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+/** @brief maps fresh demand paging pages up front */
+Error PopulateDemandPages(LinearAddress4Level addr, size_t num_4kpages);
+PageFaultStat GetPageFaultStat();
+
+/** @brief translates addr in the address space of pml4 to a physical
+ * address, which the kernel can access through the identity mapping
+ *
+ * With writable, read-only pages such as the zero page or pages of the
+ * image cache are treated as not mapped.
+ */
+WithError<uintptr_t> GetPhysicalAddress(PageMapEntry* pml4, uint64_t addr,
+                                        bool writable = false);
+/** @brief maps the pages in the current address space up front, so that
+ * their frames can be accessed without going through a page fault
+ *
+ * Demand paging pages are allocated. With writable, copy-on-write pages
+ * also get their private copy.
+ */
+Error PreparePageMaps(LinearAddress4Level addr, size_t num_4kpages,
+                      bool writable);
\ No newline at end of file
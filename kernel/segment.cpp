@@ -4,17 +4,19 @@
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 
 // #@@range_begin(tss_util)
 namespace {
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  // every CPU has its own GDT so that each can point at its own TSS
+  std::array<std::array<SegmentDescriptor, 7>, kMaxCPUs> gdt;
+  std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
 
-  static_assert((kTSS >> 3) + 1 < gdt.size());
+  static_assert((kTSS >> 3) + 1 < gdt[0].size());
 
-  void SetTSS(int index, uint64_t value) {
-    tss[index] = value & 0xffffffff;
-    tss[index + 1] = value >> 32;
+  void SetTSS(int cpu, int index, uint64_t value) {
+    tss[cpu][index] = value & 0xffffffff;
+    tss[cpu][index + 1] = value >> 32;
   }
 
   uint64_t AllocateStackArea(int num_4kframes) {
@@ -73,32 +75,33 @@ void SetSystemSegment(SegmentDescriptor& desc,
   desc.bits.long_mode = 0;
 }
 
-void SetupSegments() {
-  gdt[0].data = 0;
-  SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
-  SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
-  SetDataSegment(gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
-  SetCodeSegment(gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
-  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+void SetupSegments(int cpu) {
+  auto& g = gdt[cpu];
+  g[0].data = 0;
+  SetCodeSegment(g[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+  SetDataSegment(g[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+  SetDataSegment(g[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
+  SetCodeSegment(g[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
+  LoadGDT(sizeof(g) - 1, reinterpret_cast<uintptr_t>(&g[0]));
 }
 
-void InitializeSegmentation() {
-  SetupSegments();
+void InitializeSegmentation(int cpu) {
+  SetupSegments(cpu);
 
   SetDSAll(kKernelDS);
   SetCSSS(kKernelCS, kKernelSS);
 }
 
 
-void InitializeTSS() {
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+void InitializeTSS(int cpu) {
+  SetTSS(cpu, 1, AllocateStackArea(8));
+  SetTSS(cpu, 7 + 2 * kISTForTimer, AllocateStackArea(8));
 
 
-  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
-                   tss_addr & 0xffffffff, sizeof(tss)-1);
-  gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[cpu][0]);
+  SetSystemSegment(gdt[cpu][kTSS >> 3], DescriptorType::kTSSAvailable, 0,
+                   tss_addr & 0xffffffff, sizeof(tss[cpu])-1);
+  gdt[cpu][(kTSS >> 3) + 1].data = tss_addr >> 32;
 
   LoadTR(kTSS);
 }
\ No newline at end of file
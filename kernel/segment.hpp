@@ -36,6 +36,6 @@ const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
-void SetupSegments();
-void InitializeSegmentation();
-void InitializeTSS();
\ No newline at end of file
+void SetupSegments(int cpu);
+void InitializeSegmentation(int cpu);
+void InitializeTSS(int cpu);
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include "shared_region.hpp"
+
+#include <cstring>
+
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "slab.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+const uint64_t kWindowBegin = 0xffff'c000'0000'0000;
+const uint64_t kWindowEnd = 0xffff'c010'0000'0000;  // 64 GiB
+
+struct SharedAccess {
+    SharedAccess* next;
+    uint64_t task_id;
+};
+
+struct SharedRegion {
+    SharedRegion* next;
+    uint64_t id;
+    uint64_t creator;  // 0 once the creator has exited
+    SharedAccess* allowed;  // tasks the creator let map the region
+    FrameID frame{0};
+    size_t num_pages;
+    size_t refs;
+};
+
+struct SharedMapping {
+    SharedMapping* next;  // sorted by task, then by addr
+    uint64_t task_id;
+    uint64_t addr;
+    SharedRegion* region;
+};
+
+SlabCache region_cache{"shared_region", sizeof(SharedRegion),
+                       alignof(SharedRegion)};
+SlabCache mapping_cache{"shared_mapping", sizeof(SharedMapping),
+                        alignof(SharedMapping)};
+SlabCache access_cache{"shared_access", sizeof(SharedAccess),
+                       alignof(SharedAccess)};
+SharedRegion* regions = nullptr;
+SharedMapping* mappings = nullptr;
+uint64_t latest_region_id = 0;
+SpinLock region_lock;
+
+SharedRegion* FindRegion(uint64_t id) {
+    for (auto r = regions; r != nullptr; r = r->next) {
+        if (r->id == id) {
+            return r;
+        }
+    }
+    return nullptr;
+}
+
+bool MayMap(const SharedRegion* region, uint64_t task_id) {
+    if (region->creator == task_id) {
+        return true;
+    }
+    for (auto a = region->allowed; a != nullptr; a = a->next) {
+        if (a->task_id == task_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PutRegion(SharedRegion* region) {
+    if (--region->refs > 0) {
+        return;
+    }
+    for (auto p = &regions; *p != nullptr; p = &(*p)->next) {
+        if (*p == region) {
+            *p = region->next;
+            break;
+        }
+    }
+    while (auto a = region->allowed) {
+        region->allowed = a->next;
+        access_cache.Free(a);
+    }
+    memory_manager->Free(region->frame, region->num_pages);
+    region_cache.Free(region);
+}
+
+/** @brief first fit in the window; link is where to insert the mapping */
+uint64_t FindFreeRange(uint64_t task_id, size_t num_pages,
+                       SharedMapping**& link) {
+    uint64_t addr = kWindowBegin;
+    link = &mappings;
+    for (; *link != nullptr; link = &(*link)->next) {
+        auto m = *link;
+        if (m->task_id < task_id) {
+            continue;
+        } else if (m->task_id > task_id) {
+            break;
+        }
+        if (addr + num_pages * 4096 <= m->addr) {
+            break;
+        }
+        addr = m->addr + m->region->num_pages * 4096;
+    }
+    return addr + num_pages * 4096 <= kWindowEnd ? addr : 0;
+}
+}  // namespace
+
+WithError<uint64_t> CreateSharedRegion(Task& creator, size_t bytes) {
+    if (bytes == 0) {
+        return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    const size_t num_pages = (bytes + 4095) / 4096;
+
+    auto [frame, err] = memory_manager->Allocate(num_pages);
+    if (err) {
+        return {0, err};
+    }
+    memset(frame.Frame(), 0, num_pages * 4096);
+
+    SpinLockGuard guard{region_lock};
+    auto region = reinterpret_cast<SharedRegion*>(region_cache.Allocate());
+    if (region == nullptr) {
+        memory_manager->Free(frame, num_pages);
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    region->id = ++latest_region_id;
+    region->creator = creator.ID();
+    region->allowed = nullptr;
+    region->frame = frame;
+    region->num_pages = num_pages;
+    region->refs = 1;
+    region->next = regions;
+    regions = region;
+    return {region->id, MAKE_ERROR(Error::kSuccess)};
+}
+
+WithError<uint64_t> MapSharedRegion(Task& task, uint64_t region_id) {
+    SharedRegion* region;
+    uint64_t addr;
+    SharedMapping** link;
+    {
+        SpinLockGuard guard{region_lock};
+        region = FindRegion(region_id);
+        // ids are easy to guess, so a region the task may not map looks
+        // the same as one that does not exist
+        if (region == nullptr || !MayMap(region, task.ID())) {
+            return {0, MAKE_ERROR(Error::kNoSuchEntry)};
+        }
+        addr = FindFreeRange(task.ID(), region->num_pages, link);
+        if (addr == 0) {
+            return {0, MAKE_ERROR(Error::kFull)};
+        }
+
+        auto m = reinterpret_cast<SharedMapping*>(mapping_cache.Allocate());
+        if (m == nullptr) {
+            return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+        }
+        m->task_id = task.ID();
+        m->addr = addr;
+        m->region = region;
+        m->next = *link;
+        *link = m;
+        ++region->refs;
+    }
+
+    const auto phys = reinterpret_cast<uintptr_t>(region->frame.Frame());
+    if (auto err = SetupSharedPageMaps(LinearAddress4Level{addr},
+                                       region->num_pages, phys)) {
+        UnmapSharedRegion(task, addr);
+        return {0, err};
+    }
+    return {addr, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error AllowSharedRegion(uint64_t creator_id, uint64_t region_id,
+                        uint64_t task_id) {
+    SpinLockGuard guard{region_lock};
+    auto region = FindRegion(region_id);
+    if (region == nullptr || region->creator != creator_id) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    if (task_manager->FindTask(task_id) == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    if (MayMap(region, task_id)) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto a = reinterpret_cast<SharedAccess*>(access_cache.Allocate());
+    if (a == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    a->task_id = task_id;
+    a->next = region->allowed;
+    region->allowed = a;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapSharedRegion(Task& task, uint64_t addr) {
+    SpinLockGuard guard{region_lock};
+    for (auto p = &mappings; *p != nullptr; p = &(*p)->next) {
+        auto m = *p;
+        if (m->task_id != task.ID() || m->addr != addr) {
+            continue;
+        }
+
+        CleanSharedPageMaps(LinearAddress4Level{addr}, m->region->num_pages);
+        *p = m->next;
+        PutRegion(m->region);
+        mapping_cache.Free(m);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    return MAKE_ERROR(Error::kNoSuchEntry);
+}
+
+void ReleaseSharedRegions(uint64_t task_id) {
+    SpinLockGuard guard{region_lock};
+    // called after the task's page tables are gone, so the frames freed by
+    // PutRegion are no longer reachable from the exiting task
+    for (auto p = &mappings; *p != nullptr;) {
+        auto m = *p;
+        if (m->task_id == task_id) {
+            *p = m->next;
+            PutRegion(m->region);
+            mapping_cache.Free(m);
+        } else {
+            p = &m->next;
+        }
+    }
+
+    for (auto r = regions; r != nullptr;) {
+        auto next = r->next;
+        if (r->creator == task_id) {
+            r->creator = 0;
+            PutRegion(r);
+        }
+        r = next;
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file shared_region.hpp
+ *
+ * Memory regions that several tasks map at the same time.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+class Task;
+
+/** @brief allocates a zero-filled region of at least bytes
+ *
+ * The creator holds a reference until it exits, so the region survives
+ * until other tasks had a chance to map it. Every mapping holds one more.
+ * The frames are freed when the last reference goes.
+ */
+WithError<uint64_t> CreateSharedRegion(Task& creator, size_t bytes);
+/** @brief lets task_id map the region; only its creator may call this */
+Error AllowSharedRegion(uint64_t creator_id, uint64_t region_id,
+                        uint64_t task_id);
+/** @brief maps the region into the current address space of task
+ *
+ * Only the creator and the tasks it allowed may map the region. The
+ * address is taken from a window reserved for shared regions, away from
+ * the ELF image, the demand paging area and the stack.
+ */
+WithError<uint64_t> MapSharedRegion(Task& task, uint64_t region_id);
+Error UnmapSharedRegion(Task& task, uint64_t addr);
+/** @brief drops the mappings and creator references of an exiting task */
+void ReleaseSharedRegions(uint64_t task_id);
@@ -0,0 +1,144 @@
+#include "slab.hpp"
+
+#include "memory_manager.hpp"
+
+SlabCache* SlabCache::caches_ = nullptr;
+
+void* SlabCache::Allocate() {
+    SpinLockGuard guard{lock_};
+
+    Slab* slab = partial_;
+    if (slab == nullptr) {
+        slab = empty_;
+        if (slab) {
+            Unlink(empty_, slab);
+        } else if ((slab = NewSlab()) == nullptr) {
+            return nullptr;
+        }
+        Push(partial_, slab);
+    }
+
+    const auto index = slab->free_index[--slab->free_count];
+    ++slab->in_use;
+    if (slab->free_count == 0) {
+        Unlink(partial_, slab);
+        Push(full_, slab);
+    }
+
+    ++active_objects_;
+    ++allocations_;
+    return Object(slab, index);
+}
+
+void SlabCache::Free(void* obj) {
+    if (obj == nullptr) {
+        return;
+    }
+
+    SpinLockGuard guard{lock_};
+
+    const auto slab_bytes = slab_frames_ * kBytesPerFrame;
+    auto slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(obj) &
+                                        ~(slab_bytes - 1));
+    const auto index = (reinterpret_cast<uintptr_t>(obj) -
+                        reinterpret_cast<uintptr_t>(slab) - objects_offset_) /
+                       object_size_;
+
+    if (slab->free_count == 0) {
+        Unlink(full_, slab);
+        Push(partial_, slab);
+    }
+    slab->free_index[slab->free_count++] = index;
+    --slab->in_use;
+
+    --active_objects_;
+    ++frees_;
+
+    if (slab->in_use == 0) {
+        Unlink(partial_, slab);
+        if (empty_ == nullptr) {
+            // keep one empty slab so that alternating allocate/free at a
+            // slab boundary does not hit the frame allocator every time
+            Push(empty_, slab);
+        } else {
+            ReleaseSlab(slab);
+        }
+    }
+}
+
+SlabStat SlabCache::Stat() const {
+    return {name_,  object_size_,   capacity_, slabs_,
+            active_objects_, allocations_, frees_};
+}
+
+SlabCache::Slab* SlabCache::NewSlab() {
+    // buddy blocks are naturally aligned, so Free can find the slab header
+    // by masking the object address
+    auto [frame, err] = memory_manager->Allocate(slab_frames_);
+    if (err) {
+        return nullptr;
+    }
+    const auto slab_bytes = slab_frames_ * kBytesPerFrame;
+    if (reinterpret_cast<uintptr_t>(frame.Frame()) & (slab_bytes - 1)) {
+        memory_manager->Free(frame, slab_frames_);
+        return nullptr;
+    }
+
+    auto slab = reinterpret_cast<Slab*>(frame.Frame());
+    slab->next = slab->prev = nullptr;
+    slab->in_use = 0;
+    slab->free_count = capacity_;
+    for (size_t i = 0; i < capacity_; ++i) {
+        // hand out objects in address order
+        slab->free_index[i] = capacity_ - 1 - i;
+        if (ctor_) {
+            ctor_(Object(slab, i));
+        }
+    }
+
+    if (!registered_) {
+        registered_ = true;
+        next_cache_ = caches_;
+        caches_ = this;
+    }
+    ++slabs_;
+    return slab;
+}
+
+void SlabCache::ReleaseSlab(Slab* slab) {
+    if (dtor_) {
+        for (size_t i = 0; i < capacity_; ++i) {
+            dtor_(Object(slab, i));
+        }
+    }
+    memory_manager->Free(
+        FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame},
+        slab_frames_);
+    --slabs_;
+}
+
+void* SlabCache::Object(Slab* slab, size_t index) const {
+    return reinterpret_cast<uint8_t*>(slab) + objects_offset_ +
+           index * object_size_;
+}
+
+void SlabCache::Unlink(Slab*& list, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = nullptr;
+}
+
+void SlabCache::Push(Slab*& list, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = list;
+    if (list) {
+        list->prev = slab;
+    }
+    list = slab;
+}
@@ -0,0 +1,155 @@
+/**
+ * @file slab.hpp
+ *
+ * Object caches for frequently created kernel objects.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "spinlock.hpp"
+
+struct SlabStat {
+    const char* name;
+    size_t object_size;
+    size_t objects_per_slab;
+    size_t slabs;
+    size_t active_objects;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+/** @brief slab allocator for objects of a single size
+ *
+ * Slabs are taken directly from the frame allocator, never from the heap.
+ * If a constructor is given, it runs once for every object when its slab is
+ * created and the destructor runs when the slab is released. Objects keep
+ * their constructed state while they sit on the free list.
+ */
+class SlabCache {
+   public:
+    using ObjectFunc = void(void*);
+
+    constexpr SlabCache(const char* name, size_t object_size, size_t align,
+                        ObjectFunc* ctor = nullptr, ObjectFunc* dtor = nullptr)
+        : name_{name},
+          object_size_{RoundUp(object_size, align)},
+          align_{align},
+          ctor_{ctor},
+          dtor_{dtor},
+          slab_frames_{SlabFrames(RoundUp(object_size, align))},
+          capacity_{Capacity(RoundUp(object_size, align), align,
+                             SlabFrames(RoundUp(object_size, align)))},
+          objects_offset_{ObjectsOffset(
+              align, Capacity(RoundUp(object_size, align), align,
+                              SlabFrames(RoundUp(object_size, align))))} {}
+
+    SlabCache(const SlabCache&) = delete;
+    SlabCache& operator=(const SlabCache&) = delete;
+
+    /** @brief returns nullptr when no frame is left for a new slab */
+    void* Allocate();
+    void Free(void* obj);
+    SlabStat Stat() const;
+
+    /** @brief calls f for every cache that has created a slab */
+    template <class F>
+    static void ForEach(F f) {
+        for (auto c = caches_; c != nullptr; c = c->next_cache_) {
+            f(*c);
+        }
+    }
+
+   private:
+    struct Slab {
+        Slab* next;
+        Slab* prev;
+        uint16_t in_use;
+        uint16_t free_count;
+        uint16_t free_index[];
+    };
+
+    static const size_t kBytesPerFrame = 4096;
+    static const size_t kMinObjectsPerSlab = 8;
+    static const size_t kMaxSlabFrames = 16;
+
+    static constexpr size_t RoundUp(size_t value, size_t align) {
+        return (value + align - 1) & ~(align - 1);
+    }
+    static constexpr size_t ObjectsOffset(size_t align, size_t capacity) {
+        return RoundUp(sizeof(Slab) + sizeof(uint16_t) * capacity, align);
+    }
+    static constexpr size_t SlabFrames(size_t object_size) {
+        size_t frames = 1;
+        while (frames < kMaxSlabFrames &&
+               frames * kBytesPerFrame < kMinObjectsPerSlab * object_size +
+                                             sizeof(Slab) + 64) {
+            frames *= 2;
+        }
+        return frames;
+    }
+    static constexpr size_t Capacity(size_t object_size, size_t align,
+                                     size_t frames) {
+        size_t capacity = (frames * kBytesPerFrame - sizeof(Slab)) /
+                          (object_size + sizeof(uint16_t));
+        while (capacity > 0 && ObjectsOffset(align, capacity) +
+                                       capacity * object_size >
+                                   frames * kBytesPerFrame) {
+            --capacity;
+        }
+        return capacity;
+    }
+
+    const char* name_;
+    size_t object_size_;
+    size_t align_;
+    ObjectFunc* ctor_;
+    ObjectFunc* dtor_;
+    size_t slab_frames_;
+    size_t capacity_;
+    size_t objects_offset_;
+
+    Slab* partial_{nullptr};
+    Slab* full_{nullptr};
+    Slab* empty_{nullptr};
+    size_t slabs_{0};
+    size_t active_objects_{0};
+    uint64_t allocations_{0};
+    uint64_t frees_{0};
+    SpinLock lock_;
+
+    bool registered_{false};
+    SlabCache* next_cache_{nullptr};
+    static SlabCache* caches_;
+
+    Slab* NewSlab();
+    void ReleaseSlab(Slab* slab);
+    void* Object(Slab* slab, size_t index) const;
+    static void Unlink(Slab*& list, Slab* slab);
+    static void Push(Slab*& list, Slab* slab);
+};
+
+/** @brief typed front end of SlabCache with constructor caching
+ *
+ * T is default-constructed when its slab is created. Allocate returns an
+ * object that may have been used before, so the caller re-initializes the
+ * parts it needs.
+ */
+template <class T>
+class ObjectCache {
+   public:
+    constexpr explicit ObjectCache(const char* name)
+        : cache_{name, sizeof(T), alignof(T), Construct, Destruct} {}
+
+    T* Allocate() { return reinterpret_cast<T*>(cache_.Allocate()); }
+    void Free(T* obj) { cache_.Free(obj); }
+
+   private:
+    SlabCache cache_;
+
+    static void Construct(void* p) { new (p) T; }
+    static void Destruct(void* p) { reinterpret_cast<T*>(p)->~T(); }
+};
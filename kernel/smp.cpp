@@ -0,0 +1,156 @@
+#include "smp.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+// layout of APTrampolineParams in asmfunc.asm
+struct APStartParams {
+    uint64_t cr3, cr0, cr4;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+} __attribute__((packed));
+
+const size_t kAPStackFrames = 4;
+
+volatile uint32_t& lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+volatile uint32_t& spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+std::array<uint8_t, 256> cpu_by_lapic_id{};
+std::array<uint8_t, kMaxCPUs> lapic_ids{};
+int cpu_count = 1;
+std::array<PerCPUData, kMaxCPUs> cpu_data{};
+volatile bool ap_started;
+
+void SendIPI(uint8_t dest, uint32_t command) {
+    icr_high = static_cast<uint32_t>(dest) << 24;
+    icr_low = command;
+    while (icr_low & (1u << 12)) {  // send pending
+        __builtin_ia32_pause();
+    }
+}
+
+// a SIPI can only start a processor at a page below 1 MiB
+uintptr_t FindTrampolineFrame(const MemoryMap& memory_map) {
+    const auto base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for (uintptr_t iter = base; iter < base + memory_map.map_size;
+         iter += memory_map.descriptor_size) {
+        auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+        if (!IsAvailable(static_cast<MemoryType>(desc->type))) {
+            continue;
+        }
+        const uintptr_t start =
+            std::max<uintptr_t>(desc->physical_start, kBytesPerFrame);
+        const uintptr_t end =
+            desc->physical_start + desc->number_of_pages * kUEFIPageSize;
+        if (start + kBytesPerFrame <= std::min<uintptr_t>(end, 1_MiB)) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+[[noreturn]] void APMain(uint64_t cpu) {
+    InitializeSegmentation(cpu);
+    InitializeTSS(cpu);
+    InitializePCID();
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeSyscall();
+    InitializeFPU();
+
+    spurious_vector = 0x1ff;  // enable the local APIC
+    SetupLAPICTimer();
+
+    ap_started = true;
+    task_manager->StartCPU(cpu);
+}
+}  // namespace
+
+int CPUCount() { return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE); }
+
+PerCPUData& CPUData(int cpu) { return cpu_data[cpu]; }
+
+int CurrentCPU() { return cpu_by_lapic_id[lapic_id >> 24]; }
+
+void SendRescheduleIPI(int cpu) {
+    InterruptGuard guard;
+    SendIPI(lapic_ids[cpu], 0x4000 | InterruptVector::kReschedule);
+}
+
+void InitializeSMP(const MemoryMap& memory_map) {
+    std::array<uint8_t, kMaxCPUs> ids;
+    const size_t count = acpi::FindLocalAPICIDs(ids.data(), ids.size());
+    const uint8_t bsp_id = lapic_id >> 24;
+    lapic_ids[0] = bsp_id;
+    if (count <= 1) {
+        return;
+    }
+
+    const uintptr_t trampoline = FindTrampolineFrame(memory_map);
+    const uint64_t cr3 = GetCR3();
+    if (trampoline == 0 || (cr3 >> 32) != 0) {
+        Log(kWarn, "cannot start application processors\n");
+        return;
+    }
+
+    memcpy(reinterpret_cast<void*>(trampoline), APTrampoline,
+           APTrampolineEnd - APTrampoline);
+    auto params = reinterpret_cast<APStartParams*>(
+        trampoline + (APTrampolineParams - APTrampoline));
+    params->cr3 = cr3;
+    params->cr0 = GetCR0();
+    // PCIDE cannot be set before the AP is in long mode
+    params->cr4 = GetCR4() & ~(1ul << 17);
+    params->entry = reinterpret_cast<uint64_t>(APMain);
+
+    for (size_t i = 0; i < count && cpu_count < kMaxCPUs; ++i) {
+        if (ids[i] == bsp_id) {
+            continue;
+        }
+        auto [stack, err] = memory_manager->Allocate(kAPStackFrames);
+        if (err) {
+            break;
+        }
+
+        const int cpu = cpu_count;
+        params->stack = reinterpret_cast<uint64_t>(stack.Frame()) +
+                        kAPStackFrames * kBytesPerFrame;
+        params->arg = cpu;
+        cpu_by_lapic_id[ids[i]] = cpu;
+        lapic_ids[cpu] = ids[i];
+        ap_started = false;
+
+        SendIPI(ids[i], 0x4500);  // INIT
+        acpi::WaitMilliseconds(10);
+        for (int sipi = 0; sipi < 2 && !ap_started; ++sipi) {
+            SendIPI(ids[i], 0x4600 | (trampoline >> 12));  // STARTUP
+            acpi::WaitMilliseconds(1);
+        }
+        for (int ms = 0; ms < 100 && !ap_started; ++ms) {
+            acpi::WaitMilliseconds(1);
+        }
+        if (!ap_started) {
+            // it may still wake up later and use params, so stop here
+            Log(kWarn, "APIC ID %d did not start\n", ids[i]);
+            cpu_by_lapic_id[ids[i]] = 0;
+            break;
+        }
+        __atomic_store_n(&cpu_count, cpu + 1, __ATOMIC_RELEASE);
+    }
+}
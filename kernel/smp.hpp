@@ -0,0 +1,37 @@
+/**
+ * @file smp.hpp
+ *
+ * Startup of the application processors and inter-processor interrupts.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "memory_map.hpp"
+
+const int kMaxCPUs = 16;
+
+/** @brief data of a processor that SyscallEntry reaches through swapgs
+ *
+ * The layout is used by asmfunc.asm.
+ */
+struct PerCPUData {
+    uint64_t* os_stack_ptr;  // OSStackPointer of the running task
+} __attribute__((packed));
+
+PerCPUData& CPUData(int cpu);
+
+/** @brief number of processors running kernel code, including the BSP */
+int CPUCount();
+/** @brief index of the running processor; the BSP is 0 */
+int CurrentCPU();
+/** @brief makes cpu call TaskManager::SwitchTask as soon as possible */
+void SendRescheduleIPI(int cpu);
+
+/** @brief starts every enabled processor listed in the MADT
+ *
+ * Must be called after InitializeTask. The application processors go
+ * straight into the scheduler with their own idle task.
+ */
+void InitializeSMP(const MemoryMap& memory_map);
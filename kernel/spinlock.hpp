@@ -0,0 +1,62 @@
+/**
+ * @file spinlock.hpp
+ *
+ * Busy-wait locks for data shared between CPUs.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief test-and-test-and-set lock
+ *
+ * Interrupts must stay disabled while the lock is held, otherwise an
+ * interrupt handler taking the same lock on this CPU would spin forever.
+ * Lock and Unlock pair up like cli and sti; SpinLockGuard saves and restores
+ * IF like InterruptGuard.
+ */
+class SpinLock {
+   public:
+    void Lock() {
+        __asm__ volatile("cli" ::: "memory");
+        Acquire();
+    }
+    void Unlock() {
+        Release();
+        __asm__ volatile("sti" ::: "memory");
+    }
+
+    /** @brief takes the lock; interrupts must already be disabled */
+    void Acquire() {
+        while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) {
+                __builtin_ia32_pause();
+            }
+        }
+    }
+    void Release() { __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE); }
+
+   private:
+    uint32_t locked_{0};
+};
+
+/** @brief holds a SpinLock with interrupts disabled for a scope */
+class SpinLockGuard {
+   public:
+    explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {
+        __asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags_)::"memory");
+        lock_.Acquire();
+    }
+    ~SpinLockGuard() {
+        lock_.Release();
+        if (rflags_ & 0x200) {
+            __asm__ volatile("sti" ::: "memory");
+        }
+    }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+   private:
+    SpinLock& lock_;
+    uint64_t rflags_;
+};
@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cmath>
@@ -10,13 +11,19 @@
 
 #include "asmfunc.h"
 #include "font.hpp"
+#include "grant.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 #include "msr.hpp"
+#include "shared_region.hpp"
+#include "slab.hpp"
 #include "system.hpp"
 #include "task.hpp"
 #include "timer.hpp"
 
+// incremented by SyscallEntry before dispatching
+extern "C" std::array<uint64_t, kSyscallStatCount> syscall_count{};
+
 namespace syscall {
 struct Result {
     uint64_t value;
@@ -52,30 +59,127 @@ SYSCALL(CreateTimer) {
         timeout += timer_manager->CurrentTick();
     }
 
+    auto err = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    if (err) {
+        return {0, ENOMEM};
+    }
+    return {timeout * 1000 / kTimerFreq, 0};
+}
+
+SYSCALL(GetTimeNs) { return {CurrentTimeNs(), 0}; }
+
+SYSCALL(CreateTimerNs) {
+    const unsigned int mode = arg1;
+    const int timer_value = arg2;
+    if (timer_value <= 0) {
+        return {0, EINVAL};
+    }
+
     __asm__("cli");
-    timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    const uint64_t task_id = task_manager->CurrentTask().ID();
     __asm__("sti");
-    return {timeout * 1000 / kTimerFreq, 0};
+
+    uint64_t timeout = arg3;
+    uint64_t period = 0;
+    if (mode & 2) {  // periodic, starting one period from now
+        if (timeout == 0) {
+            return {0, EINVAL};
+        }
+        period = timeout;
+        timeout += CurrentTimeNs();
+    } else if (mode & 1) {  // relative
+        timeout += CurrentTimeNs();
+    }
+
+    auto err = timer_manager->AddHRTimer(
+        Timer{timeout, -timer_value, task_id, period});
+    if (err) {
+        return {0, ENOMEM};
+    }
+    return {timeout, 0};
+}
+
+SYSCALL(Sleep) {
+    const uint64_t deadline = CurrentTimeNs() + arg1;
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    // the timer fires on this CPU, so it cannot go off between AddHRTimer
+    // and Sleep; a message may still wake the task up early
+    while (CurrentTimeNs() < deadline) {
+        task_lock.Lock();
+        auto err = timer_manager->AddHRTimer(
+            Timer{deadline, Timer::kWakeup, task.ID()});
+        if (!err) {
+            task.Sleep();
+        }
+        task_lock.Unlock();
+        if (err) {
+            return {0, ENOMEM};
+        }
+        timer_manager->CancelTimer(task.ID(), Timer::kWakeup);
+    }
+    return {0, 0};
+}
+
+SYSCALL(CancelTimer) {
+    const int timer_value = arg1;
+    if (timer_value <= 0) {
+        return {0, EINVAL};
+    }
+
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    return {timer_manager->CancelTimer(task_id, -timer_value), 0};
 }
 
 SYSCALL(DemandPages) {
     const size_t num_pages = arg1;
+    const int flags = arg2;
     __asm__("cli");
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
     const uint64_t dp_end = task.DPagingEnd();
+    if (flags & 2) {
+        if (num_pages > (dp_end - task.DPagingBegin()) / 4096) {
+            return {0, EINVAL};
+        }
+        const uint64_t new_end = dp_end - 4096 * num_pages;
+        task.SetDPagingEnd(new_end);
+        if (auto err = UnmapPages(LinearAddress4Level{new_end}, num_pages)) {
+            return {0, ENOMEM};
+        }
+        return {new_end, 0};
+    }
+
     task.SetDPagingEnd(dp_end + 4096 * num_pages);
+    if (flags & 1) {
+        // whatever cannot be mapped now is still paged in on first touch
+        PopulateDemandPages(LinearAddress4Level{dp_end}, num_pages);
+    }
     return {dp_end, 0};
 }
 
-SYSCALL(CreateNewTask) { return {task_manager->NewTask().ID(), 0}; }
+SYSCALL(CreateNewTask) {
+    task_lock.Lock();
+    Task *task = task_manager->NewTask();
+    task_lock.Unlock();
+    if (task == nullptr) {
+        return {0, EAGAIN};
+    }
+    return {task->ID(), 0};
+}
 
 SYSCALL(CopyToTaskBuffer) {
     uint64_t id = arg1;
     void *buf = reinterpret_cast<void *>(arg2);
     size_t offset = arg3;
     size_t len = arg4;
+    SpinLockGuard guard{task_lock};
     int remain_bytes = task_manager->CopyToTaskBuffer(id, buf, offset, len);
     if (remain_bytes == -1) {
         return {0, EFBIG};
@@ -88,6 +192,7 @@ SYSCALL(SetCommand) {
     uint64_t id = arg1;
     char *command = reinterpret_cast<char *>(arg2);
 
+    SpinLockGuard guard{task_lock};
     auto task = task_manager->FindTask(id);
 
     if (task == nullptr) {
@@ -102,6 +207,7 @@ SYSCALL(SetArgument) {
     uint64_t id = arg1;
     char *arg = reinterpret_cast<char *>(arg2);
 
+    SpinLockGuard guard{task_lock};
     auto task = task_manager->FindTask(id);
 
     if (task == nullptr) {
@@ -114,30 +220,28 @@ SYSCALL(SetArgument) {
 
 SYSCALL(FindServer) {
     const char *name = reinterpret_cast<const char *>(arg1);
+    task_lock.Lock();
     uint64_t task_id = task_manager->FindTask(name);
+    task_lock.Unlock();
     if (task_id == 0) {
         return {0, ESRCH};
     }
     return {task_id, 0};
 }
 
-SYSCALL(OpenReceiveMessage) {
-    const auto receive_message = reinterpret_cast<Message *>(arg1);
-    const size_t len = arg2;
-
-    __asm__("cli");
-    auto &task = task_manager->CurrentTask();
-    __asm__("sti");
+namespace {
+size_t ReceiveMessages(Task &task, Message *receive_message, size_t len) {
     size_t i = 0;
 
     while (i < len) {
-        __asm__("cli");
+        task_lock.Lock();
         auto msg = task.ReceiveMessage();
         if (!msg && i == 0) {
-            task.Sleep();
+            task.WaitMessage();
+            task_lock.Unlock();
             continue;
         }
-        __asm__("sti");
+        task_lock.Unlock();
 
         if (!msg) {
             break;
@@ -148,50 +252,69 @@ SYSCALL(OpenReceiveMessage) {
         receive_message[i].arg = msg->arg;
         ++i;
     }
-    return {i, 0};
+    return i;
 }
 
-SYSCALL(ClosedReceiveMessage) {
-    const auto receive_message = reinterpret_cast<Message *>(arg1);
-    const size_t len = arg2;
-    uint64_t target_id = arg3;
-
-    __asm__("cli");
-    auto &task = task_manager->CurrentTask();
-    __asm__("sti");
+// messages from other tasks stay queued for a later receive
+size_t ReceiveMessagesFrom(Task &task, Message *receive_message, size_t len,
+                           uint64_t target_id) {
     size_t i = 0;
 
     while (i < len) {
-        __asm__("cli");
-        auto msg = task.ReceiveMessage();
+        task_lock.Lock();
+        auto msg = task.ReceiveMessageFrom(target_id);
         if (!msg && i == 0) {
-            task.Sleep();
+            task.WaitMessage(target_id);
+            task_lock.Unlock();
             continue;
         }
-        __asm__("sti");
+        task_lock.Unlock();
 
         if (!msg) {
             break;
         }
 
-        if (msg->src_task != target_id) {
-            Message emsg;
-            emsg.type = Message::kError;
-            emsg.arg.error.retry = true;
-            emsg.src_task = task.ID();
-
-            __asm__("cli");
-            task_manager->SendMessage(msg->src_task, emsg);
-            __asm__("sti");
-            continue;
-        }
-
         receive_message[i].type = msg->type;
         receive_message[i].src_task = msg->src_task;
         receive_message[i].arg = msg->arg;
         ++i;
     }
-    return {i, 0};
+    return i;
+}
+
+Error SendMessageFrom(Task &task, const Message *send_message, uint64_t id) {
+    Message msg;
+    msg = *send_message;
+    msg.src_task = task.ID();
+
+    task_lock.Lock();
+    auto err = task_manager->HandoffMessage(id, msg);
+    task_lock.Unlock();
+    return err;
+}
+}  // namespace
+
+SYSCALL(OpenReceiveMessage) {
+    const auto receive_message = reinterpret_cast<Message *>(arg1);
+    const size_t len = arg2;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    return {ReceiveMessages(task, receive_message, len), 0};
+}
+
+SYSCALL(ClosedReceiveMessage) {
+    const auto receive_message = reinterpret_cast<Message *>(arg1);
+    const size_t len = arg2;
+    uint64_t target_id = arg3;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    return {ReceiveMessagesFrom(task, receive_message, len, target_id), 0};
 }
 
 SYSCALL(SendMessage) {
@@ -202,15 +325,82 @@ SYSCALL(SendMessage) {
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
-    Message msg;
-    msg = *send_message;
-    msg.src_task = task.ID();
+    SendMessageFrom(task, send_message, id);
+    return {0, 0};
+}
+
+SYSCALL(SendMessages) {
+    const auto send_messages = reinterpret_cast<const Message *>(arg1);
+    const size_t n = arg2;
+    uint64_t id = arg3;
 
     __asm__("cli");
-    task_manager->SendMessage(id, msg);
+    auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
-    return {0, 0};
+    // the receiver is only handed the CPU once, after the last chunk
+    const size_t kChunk = 16;
+    Message msgs[kChunk];
+    size_t sent = 0;
+    while (sent < n) {
+        const size_t count = std::min(kChunk, n - sent);
+        for (size_t i = 0; i < count; ++i) {
+            msgs[i] = send_messages[sent + i];
+            msgs[i].src_task = task.ID();
+        }
+
+        task_lock.Lock();
+        WithError<size_t> result{0, MAKE_ERROR(Error::kSuccess)};
+        if (sent + count < n) {
+            if (auto dest = task_manager->FindTask(id)) {
+                result = dest->SendMessages(msgs, count);
+            } else {
+                result.error = MAKE_ERROR(Error::kNoSuchTask);
+            }
+        } else {
+            result = task_manager->HandoffMessages(id, msgs, count);
+        }
+        task_lock.Unlock();
+
+        sent += result.value;
+        if (result.error) {
+            if (result.error.Cause() == Error::kNoSuchTask) {
+                return {sent, ESRCH};
+            }
+            return {sent, ENOMEM};
+        }
+    }
+    return {sent, 0};
+}
+
+SYSCALL(Call) {
+    const auto send_message = reinterpret_cast<Message *>(arg1);
+    uint64_t id = arg2;
+    const auto reply_message = reinterpret_cast<Message *>(arg3);
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    if (SendMessageFrom(task, send_message, id)) {
+        return {0, ESRCH};
+    }
+    return {ReceiveMessagesFrom(task, reply_message, 1, id), 0};
+}
+
+SYSCALL(ReplyWait) {
+    uint64_t reply_to = arg1;
+    const auto reply_message = reinterpret_cast<Message *>(arg2);
+    const auto receive_message = reinterpret_cast<Message *>(arg3);
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    if (reply_to != 0) {
+        SendMessageFrom(task, reply_message, reply_to);
+    }
+    return {ReceiveMessages(task, receive_message, 1), 0};
 }
 
 SYSCALL(WritePixel) {
@@ -284,13 +474,212 @@ SYSCALL(WriteKernelLog) {
     return {0, 0};
 }
 
+SYSCALL(Grant) {
+    const uint64_t addr = arg1;
+    const size_t len = arg2;
+    const uint64_t grantee = arg3;
+    const int flags = arg4;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto [id, err] = CreateGrant(task, addr, len, grantee, flags);
+    if (err.Cause() == Error::kNoSuchTask) {
+        return {0, ESRCH};
+    } else if (err.Cause() == Error::kNoEnoughMemory) {
+        return {0, ENOMEM};
+    } else if (err) {
+        return {0, EINVAL};
+    }
+    return {id, 0};
+}
+
+SYSCALL(RevokeGrant) {
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    if (::RevokeGrant(task_id, arg1)) {
+        return {0, EINVAL};
+    }
+    return {0, 0};
+}
+
+SYSCALL(PassGrant) {
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    if (auto err = ::PassGrant(task_id, arg1, arg2)) {
+        return {0, err.Cause() == Error::kNoSuchTask ? ESRCH : EINVAL};
+    }
+    return {0, 0};
+}
+
+SYSCALL(CopyFromGrant) {
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    auto [n, err] = ::CopyFromGrant(task_id, arg1, arg2,
+                                    reinterpret_cast<void *>(arg3), arg4);
+    if (err) {
+        return {n, EFAULT};
+    }
+    return {n, 0};
+}
+
+SYSCALL(CopyToGrant) {
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    auto [n, err] = ::CopyToGrant(task_id, arg1, arg2,
+                                  reinterpret_cast<const void *>(arg3), arg4);
+    if (err) {
+        return {n, EFAULT};
+    }
+    return {n, 0};
+}
+
+SYSCALL(CreateSharedRegion) {
+    const size_t bytes = arg1;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto [id, err] = ::CreateSharedRegion(task, bytes);
+    if (err.Cause() == Error::kNoEnoughMemory) {
+        return {0, ENOMEM};
+    } else if (err) {
+        return {0, EINVAL};
+    }
+    return {id, 0};
+}
+
+SYSCALL(AllowSharedRegion) {
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    __asm__("sti");
+
+    if (auto err = ::AllowSharedRegion(task_id, arg1, arg2)) {
+        if (err.Cause() == Error::kNoSuchTask) {
+            return {0, ESRCH};
+        } else if (err.Cause() == Error::kNoEnoughMemory) {
+            return {0, ENOMEM};
+        }
+        return {0, EINVAL};
+    }
+    return {0, 0};
+}
+
+SYSCALL(MapSharedRegion) {
+    const uint64_t id = arg1;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto [addr, err] = ::MapSharedRegion(task, id);
+    if (err.Cause() == Error::kNoSuchEntry) {
+        return {0, EINVAL};
+    } else if (err) {
+        return {0, ENOMEM};
+    }
+    return {addr, 0};
+}
+
+SYSCALL(UnmapSharedRegion) {
+    const uint64_t addr = arg1;
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    if (::UnmapSharedRegion(task, addr)) {
+        return {0, EINVAL};
+    }
+    return {0, 0};
+}
+
+SYSCALL(GetStat) {
+    const auto kind = static_cast<StatKind>(arg1);
+    void *buf = reinterpret_cast<void *>(arg2);
+    const size_t len = arg3;
+
+    switch (kind) {
+        case kStatIPC: {
+            if (len < sizeof(IPCStat)) {
+                return {0, EINVAL};
+            }
+            task_lock.Lock();
+            const auto stat = task_manager->GetIPCStat();
+            task_lock.Unlock();
+            memcpy(buf, &stat, sizeof(stat));
+            return {sizeof(stat), 0};
+        }
+        case kStatSyscall: {
+            if (len < sizeof(SyscallStat)) {
+                return {0, EINVAL};
+            }
+            SyscallStat stat;
+            memcpy(stat.calls, syscall_count.data(), sizeof(stat.calls));
+            memcpy(buf, &stat, sizeof(stat));
+            return {sizeof(stat), 0};
+        }
+        case kStatCPU: {
+            if (len < sizeof(CPUStat)) {
+                return {0, EINVAL};
+            }
+            task_lock.Lock();
+            const auto stat = task_manager->GetCPUStat();
+            task_lock.Unlock();
+            memcpy(buf, &stat, sizeof(stat));
+            return {sizeof(stat), 0};
+        }
+        case kStatPageFault: {
+            if (len < sizeof(PageFaultStat)) {
+                return {0, EINVAL};
+            }
+            const auto stat = GetPageFaultStat();
+            memcpy(buf, &stat, sizeof(stat));
+            return {sizeof(stat), 0};
+        }
+        case kStatSlab: {
+            if (len < sizeof(SlabStats)) {
+                return {0, EINVAL};
+            }
+            SlabStats stat{};
+            SlabCache::ForEach([&stat](const SlabCache &cache) {
+                if (stat.caches < kSlabStatCount) {
+                    const auto s = cache.Stat();
+                    auto &entry = stat.cache[stat.caches];
+                    strncpy(entry.name, s.name, sizeof(entry.name) - 1);
+                    entry.object_size = s.object_size;
+                    entry.objects_per_slab = s.objects_per_slab;
+                    entry.slabs = s.slabs;
+                    entry.active_objects = s.active_objects;
+                    entry.allocations = s.allocations;
+                    entry.frees = s.frees;
+                }
+                ++stat.caches;
+            });
+            memcpy(buf, &stat, sizeof(stat));
+            return {sizeof(stat), 0};
+        }
+    }
+    return {0, EINVAL};
+}
+
 #undef SYSCALL
 
 }  // namespace syscall
 
 using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t, uint64_t,
                                         uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType *, 0x14> syscall_table{
+extern "C" std::array<SyscallFuncType *, 0x25> syscall_table{
     /* 0x00 */ syscall::Exit,
     /* 0x01 */ syscall::GetCurrentTick,
     /* 0x02 */ syscall::CreateTimer,
@@ -311,6 +700,23 @@ extern "C" std::array<SyscallFuncType *, 0x14> syscall_table{
     /* 0x11 */ syscall::CopyToVolumeImage,
     /* 0x12 */ syscall::ReadKernelLog,
     /* 0x13 */ syscall::WriteKernelLog,
+    /* 0x14 */ syscall::Call,
+    /* 0x15 */ syscall::ReplyWait,
+    /* 0x16 */ syscall::GetStat,
+    /* 0x17 */ syscall::Grant,
+    /* 0x18 */ syscall::RevokeGrant,
+    /* 0x19 */ syscall::PassGrant,
+    /* 0x1a */ syscall::CopyFromGrant,
+    /* 0x1b */ syscall::CopyToGrant,
+    /* 0x1c */ syscall::CreateSharedRegion,
+    /* 0x1d */ syscall::MapSharedRegion,
+    /* 0x1e */ syscall::UnmapSharedRegion,
+    /* 0x1f */ syscall::SendMessages,
+    /* 0x20 */ syscall::CancelTimer,
+    /* 0x21 */ syscall::GetTimeNs,
+    /* 0x22 */ syscall::CreateTimerNs,
+    /* 0x23 */ syscall::Sleep,
+    /* 0x24 */ syscall::AllowSharedRegion,
 
 };
 
@@ -319,5 +725,8 @@ void InitializeSyscall() {
     WriteMSR(kIA32_LSTAR, reinterpret_cast<uint64_t>(SyscallEntry));
     WriteMSR(kIA32_STAR, static_cast<uint64_t>(8) << 32 |
                              static_cast<uint64_t>(16 | 3) << 48);
-    WriteMSR(kIA32_FMASK, 0);
+    // SyscallEntry sets IF again once it has left the swapped GS base
+    WriteMSR(kIA32_FMASK, 0x200);
+    WriteMSR(kIA32_KERNEL_GS_BASE,
+             reinterpret_cast<uint64_t>(&CPUData(CurrentCPU())));
 }
\ No newline at end of file
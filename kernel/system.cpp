@@ -1,11 +1,15 @@
 #include "system.hpp"
 
+#include <cctype>
 #include <cstring>
 #include <limits>
 
 #include "asmfunc.h"
+#include "grant.hpp"
+#include "image_cache.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
+#include "shared_region.hpp"
 
 /*--------------------------------------------------------------------------
  * functions to execute file
@@ -81,30 +85,29 @@ uintptr_t GetFirstLoadAddress(Elf64_Ehdr *ehdr) {
 
 static_assert(kBytesPerFrame >= 4096);
 
-WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr *ehdr) {
+// the segments are paged in by HandlePageFault when they are touched
+WithError<uint64_t> MapLoadSegments(Elf64_Ehdr *ehdr, Task &task) {
     auto phdr = GetProgramHeader(ehdr);
     uint64_t last_addr = 0;
     for (int i = 0; i < ehdr->e_phnum; ++i) {
         if (phdr[i].p_type != PT_LOAD) continue;
+        if (phdr[i].p_filesz > phdr[i].p_memsz) {
+            return {last_addr, MAKE_ERROR(Error::kInvalidFormat)};
+        }
 
-        LinearAddress4Level dest_addr;
-        dest_addr.value = phdr[i].p_vaddr;
         last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
-        const auto num_4kpages = (phdr[i].p_memsz + 4095) / 4096;
-
-        if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
+        const FileMapping mapping{phdr[i].p_vaddr,
+                                  phdr[i].p_vaddr + phdr[i].p_memsz,
+                                  phdr[i].p_vaddr + phdr[i].p_filesz,
+                                  (phdr[i].p_flags & PF_W) != 0};
+        if (auto err = task.AddFileMapping(mapping)) {
             return {last_addr, err};
         }
-
-        const auto src = reinterpret_cast<uint8_t *>(ehdr) + phdr[i].p_offset;
-        const auto dst = reinterpret_cast<uint8_t *>(phdr[i].p_vaddr);
-        memcpy(dst, src, phdr[i].p_filesz);
-        memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
     }
     return {last_addr, MAKE_ERROR(Error::kSuccess)};
 }
 
-WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr) {
+WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr, Task &task) {
     if (ehdr->e_type != ET_EXEC) {
         return {0, MAKE_ERROR(Error::kInvalidFormat)};
     }
@@ -114,7 +117,10 @@ WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr) {
         return {0, MAKE_ERROR(Error::kInvalidFormat)};
     }
 
-    return CopyLoadSegments(ehdr);
+    if (auto err = task.ReserveFileMappings(ehdr->e_phnum)) {
+        return {0, err};
+    }
+    return MapLoadSegments(ehdr, task);
 }
 
 WithError<PageMapEntry *> SetupPML4(Task &current_task) {
@@ -123,11 +129,10 @@ WithError<PageMapEntry *> SetupPML4(Task &current_task) {
         return pml4;
     }
 
-    const auto current_pml4 = reinterpret_cast<PageMapEntry *>(GetCR3());
-    memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
+    memcpy(pml4.value, CurrentPML4(), 256 * sizeof(uint64_t));
 
-    const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
-    SetCR3(cr3);
+    const auto cr3 = NewAddressSpace(pml4.value);
+    SwitchAddressSpace(cr3);
     current_task.Context().cr3 = cr3;
     return pml4;
 }
@@ -136,6 +141,12 @@ Error FreePML4(Task &current_task) {
     const auto cr3 = current_task.Context().cr3;
     current_task.Context().cr3 = 0;
     ResetCR3();
+    ReleaseAddressSpace(cr3);
+    current_task.ClearFileMappings();
+    if (auto image = current_task.Image()) {
+        current_task.SetImage(nullptr);
+        ReleaseExecImage(image);
+    }
 
     const FrameID frame{cr3 / kBytesPerFrame};
     return memory_manager->Free(frame, 1);
@@ -148,45 +159,53 @@ Error FreePML4(Task &current_task) {
  * @param task task for application
  * @return WithError<AppLoadInfo>
  */
-WithError<AppLoadInfo> LoadApp(Elf64_Ehdr *elf_header, Task &task) {
-    PageMapEntry *temp_pml4;
+WithError<AppLoadInfo> LoadApp(Elf64_Ehdr *elf_header, size_t elf_bytes,
+                               Task &task) {
+    PageMapEntry *pml4;
 
-    if (auto [pml4, err] = SetupPML4(task); err) {
+    if (auto [new_pml4, err] = SetupPML4(task); err) {
         return {{}, err};
     } else {
-        temp_pml4 = pml4;
+        pml4 = new_pml4;
     }
 
     if (memcmp(elf_header->e_ident,
                "\x7f"
                "ELF",
                4) != 0) {
+        FreePML4(task);
         return {{}, MAKE_ERROR(Error::kInvalidFile)};
     }
 
-    auto [last_addr, err_load] = LoadELF(elf_header);
+    auto [image, err_image] = AcquireExecImage(
+        reinterpret_cast<const uint8_t *>(elf_header), elf_bytes);
+    if (err_image) {
+        FreePML4(task);
+        return {{}, err_image};
+    }
+    task.SetImage(image);
+
+    auto [last_addr, err_load] = LoadELF(elf_header, task);
     if (err_load) {
+        FreePML4(task);  // releases the image as well
         return {{}, err_load};
     }
+    const AppLoadInfo info{last_addr, elf_header->e_entry, pml4};
 
-    AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-
-    if (auto [pml4, err] = SetupPML4(task); err) {
-        return {app_load, err};
-    } else {
-        app_load.pml4 = pml4;
-    }
-    auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
-    return {app_load, err};
+    // pages come from the image from now on, so the file read into the
+    // task buffer is no longer needed
+    task.buf_.Resize(0);
+    return {info, MAKE_ERROR(Error::kSuccess)};
 }
 }  // namespace
 
-WithError<int> ExecuteServer(Elf64_Ehdr *elf_header, char *server_name) {
+WithError<int> ExecuteServer(Elf64_Ehdr *elf_header, size_t elf_bytes,
+                             char *server_name) {
     __asm__("cli");
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
-    auto [app_load, err] = LoadApp(elf_header, task);
+    auto [app_load, err] = LoadApp(elf_header, elf_bytes, task);
     if (err) {
         return {0, err};
     }
@@ -222,20 +241,25 @@ WithError<int> ExecuteServer(Elf64_Ehdr *elf_header, char *server_name) {
         CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
                 stack_frame_addr.value + 4096 - 8, &task.OSStackPointer());
 
-    if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-        return {ret, err};
+    ReleaseGrants(task.ID());
+    auto clean_err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000});
+    auto free_err = FreePML4(task);
+    // shared frames may be freed only once the task can no longer reach them
+    ReleaseSharedRegions(task.ID());
+    if (clean_err) {
+        return {ret, clean_err};
     }
 
-    return {ret, FreePML4(task)};
+    return {ret, free_err};
 }
 
-WithError<int> ExecuteApp(Elf64_Ehdr *elf_header, char *command,
-                          char *first_arg) {
+WithError<int> ExecuteApp(Elf64_Ehdr *elf_header, size_t elf_bytes,
+                          char *command, char *first_arg) {
     __asm__("cli");
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
-    auto [app_load, err] = LoadApp(elf_header, task);
+    auto [app_load, err] = LoadApp(elf_header, elf_bytes, task);
     if (err) {
         return {0, err};
     }
@@ -270,11 +294,16 @@ WithError<int> ExecuteApp(Elf64_Ehdr *elf_header, char *command,
         CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
                 stack_frame_addr.value + 4096 - 8, &task.OSStackPointer());
 
-    if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-        return {ret, err};
+    ReleaseGrants(task.ID());
+    auto clean_err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000});
+    auto free_err = FreePML4(task);
+    // shared frames may be freed only once the task can no longer reach them
+    ReleaseSharedRegions(task.ID());
+    if (clean_err) {
+        return {ret, clean_err};
     }
 
-    return {ret, FreePML4(task)};
+    return {ret, free_err};
 };
 
 extern const uint8_t _binary____servers_init_init_start;
@@ -291,7 +320,8 @@ void TaskInitServer(uint64_t task_id, int64_t data) {
     memcpy(&file_buf[0], &_binary____servers_init_init_start, binary_init_size);
     auto elf_header = reinterpret_cast<Elf64_Ehdr *>(&file_buf[0]);
 
-    auto [ec, err] = ExecuteServer(elf_header, task_of_server_data->file_name);
+    auto [ec, err] = ExecuteServer(elf_header, binary_init_size,
+                                   task_of_server_data->file_name);
     if (err) {
         printk("[ kinOS ] cannnot execute server\n");
     }
@@ -306,7 +336,7 @@ void TaskServer(uint64_t task_id, int64_t init_id) {
 
     auto elf_header = reinterpret_cast<Elf64_Ehdr *>(&task.buf_[0]);
 
-    auto [ec, err] = ExecuteServer(elf_header, task.arg_);
+    auto [ec, err] = ExecuteServer(elf_header, task.buf_.Size(), task.arg_);
     if (err) {
         printk("[ kinOS ] cannnot execute server\n");
     }
@@ -316,7 +346,9 @@ void TaskServer(uint64_t task_id, int64_t init_id) {
     msg.type = Message::kExitServer;
     msg.src_task = 1;
     strcpy(msg.arg.exitserver.name, task.arg_);
+    task_lock.Lock();
     task_manager->SendMessage(init_id, msg);
+    task_lock.Unlock();
 
     task_manager->Finish(1);
 
@@ -330,7 +362,8 @@ void TaskApp(uint64_t task_id, int64_t am_id) {
 
     auto elf_header = reinterpret_cast<Elf64_Ehdr *>(&task.buf_[0]);
 
-    auto [ec, err] = ExecuteApp(elf_header, task.command_, task.arg_);
+    auto [ec, err] =
+        ExecuteApp(elf_header, task.buf_.Size(), task.command_, task.arg_);
 
     // if exit application or some error at executing application return here
     Message msg;
@@ -338,22 +371,26 @@ void TaskApp(uint64_t task_id, int64_t am_id) {
     msg.src_task = task.ID();
     msg.arg.exitapp.id = task.ID();
     msg.arg.exitapp.result = ec;
+    task_lock.Lock();
     task_manager->SendMessage(am_id, msg);
+    task_lock.Unlock();
 
     while (true) {
-        __asm__("cli");
+        task_lock.Lock();
         auto rmsg = task.ReceiveMessage();
         if (!rmsg) {
-            task.Sleep();
-            __asm__("sti");
+            task.WaitMessage();
+            task_lock.Unlock();
             continue;
         }
-        __asm__("sti");
+        task_lock.Unlock();
 
         switch (rmsg->type) {
             case Message::kError:
                 if (rmsg->arg.error.retry) {
+                    task_lock.Lock();
                     task_manager->SendMessage(am_id, msg);
+                    task_lock.Unlock();
                 }
                 break;
             case Message::kReceived:
@@ -376,6 +413,8 @@ char kernel_log_buf[1024];
 size_t kernel_log_head;
 size_t kernel_log_tail;
 bool kernel_log_changed;
+// printk may run on several CPUs at once
+SpinLock kernel_log_lock;
 
 void InitializeSystemTask(void *volume_image) {
     v_image = reinterpret_cast<uint8_t *>(volume_image);
@@ -384,13 +423,14 @@ void InitializeSystemTask(void *volume_image) {
     kernel_log_tail = 0;
     kernel_log_changed = false;
 
-    Task &init_task = task_manager->NewTask();
     auto init_server_data = new DataOfServer{
         "servers/init",
     };
 
+    SpinLockGuard guard{task_lock};
+    Task *init_task = task_manager->NewTask();
     init_task
-        .InitContext(TaskInitServer,
+        ->InitContext(TaskInitServer,
                      reinterpret_cast<uint64_t>(init_server_data))
         .Wakeup();
 }
@@ -419,6 +459,7 @@ void CopyToImage(void *buf, size_t offset_by_sector, size_t len_by_sector) {
 }
 
 void KernelLogWrite(char *s) {
+    SpinLockGuard guard{kernel_log_lock};
     int i = kernel_log_head;
     if (kernel_log_changed) {
         kernel_log_head = kernel_log_tail;
@@ -435,6 +476,7 @@ void KernelLogWrite(char *s) {
 }
 
 size_t KernelLogRead(char *buf, size_t len) {
+    SpinLockGuard guard{kernel_log_lock};
     size_t remaining = len;
     if (kernel_log_head > kernel_log_tail) {
         int copy_len =
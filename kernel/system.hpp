@@ -23,9 +23,10 @@ void TaskInitServer(uint64_t task_id, int64_t data);
 void TaskServer(uint64_t task_id, int64_t init_id);
 void TaskApp(uint64_t task_id, int64_t am_id);
 
-WithError<int> ExecuteServer(Elf64_Ehdr *elf_header, char *server_name);
-WithError<int> ExecuteApp(Elf64_Ehdr *elf_header, char *command,
-                          char *first_arg);
+WithError<int> ExecuteServer(Elf64_Ehdr *elf_header, size_t elf_bytes,
+                             char *server_name);
+WithError<int> ExecuteApp(Elf64_Ehdr *elf_header, size_t elf_bytes,
+                          char *command, char *first_arg);
 
 extern uint8_t *v_image;
 
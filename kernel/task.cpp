@@ -1,30 +1,284 @@
 #include "task.hpp"
 
+#include <cstring>
+#include <new>
+
 #include "asmfunc.h"
+#include "fpu.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
 #include "segment.hpp"
+#include "slab.hpp"
 #include "system.hpp"
 #include "timer.hpp"
 
 namespace {
-template <class T, class U>
-void Erase(T &c, const U &value) {
-    auto it = std::remove(c.begin(), c.end(), value);
-    c.erase(it, c.end());
+uint32_t NameHash(const char *name) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (; *name; ++name) {
+        hash = (hash ^ static_cast<uint8_t>(*name)) * 16777619u;
+    }
+    return hash;
 }
 
 void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+    while (true) {
+        // anything that becomes runnable preempts the idle task
+        while (RefillZeroedFrames()) {
+        }
+        __asm__("hlt");
+    }
 }
+
+ObjectCache<Task> task_cache{"task"};
+SlabCache message_cache{"message", sizeof(MessageNode), alignof(MessageNode)};
+SlabCache finish_record_cache{"finish_record",
+                              sizeof(TaskManager::FinishRecord),
+                              alignof(TaskManager::FinishRecord)};
+
+// counters of the queues; the interrupt rings keep their own
+IPCStat ipc_stat{};
+
+// RestoreContext runs on these between leaving one task and entering the
+// next, so a finished task can be freed and a sleeping one woken elsewhere
+alignas(16) std::array<std::array<uint8_t, 8192>, kMaxCPUs> switch_stacks;
 }  // namespace
 
-Task::Task(uint64_t id) : id_{id} {}
+SpinLock task_lock;
+
+TaskBuffer::~TaskBuffer() { Resize(0); }
+
+Error TaskBuffer::Resize(size_t bytes) {
+    const size_t frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    if (frames == frames_) {
+        bytes_ = bytes;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    uint8_t *data = nullptr;
+    if (frames > 0) {
+        auto [frame, err] = memory_manager->Allocate(frames);
+        if (err) {
+            return err;
+        }
+        data = reinterpret_cast<uint8_t *>(frame.Frame());
+        memcpy(data, data_, std::min(bytes, bytes_));
+    }
+    if (frames_ > 0) {
+        memory_manager->Free(
+            FrameID{reinterpret_cast<uintptr_t>(data_) / kBytesPerFrame},
+            frames_);
+    }
+
+    data_ = data;
+    bytes_ = bytes;
+    frames_ = frames;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void MessageQueue::Push(MessageNode *node) {
+    node->next = nullptr;
+    if (tail_) {
+        tail_->next = node;
+    } else {
+        head_ = node;
+    }
+    tail_ = node;
+}
+
+MessageNode *MessageQueue::Pop() {
+    auto node = head_;
+    if (node) {
+        head_ = node->next;
+        if (head_ == nullptr) {
+            tail_ = nullptr;
+        }
+    }
+    return node;
+}
+
+MessageNode *MessageQueue::PopFrom(uint64_t src, uint64_t &newly_deferred) {
+    MessageNode *prev = nullptr;
+    for (auto node = head_; node != nullptr; prev = node, node = node->next) {
+        if (node->msg.src_task != src) {
+            if (!node->deferred) {
+                node->deferred = true;
+                ++newly_deferred;
+            }
+            continue;
+        }
+
+        if (prev) {
+            prev->next = node->next;
+        } else {
+            head_ = node->next;
+        }
+        if (tail_ == node) {
+            tail_ = prev;
+        }
+        return node;
+    }
+    return nullptr;
+}
+
+Error InterruptMessageRing::Push(const Message &msg, bool merge) {
+    if (msg.type == Message::kInterruptXHCI ||
+        (merge && msg.type == Message::kTimerTimeout)) {
+        for (size_t i = 0; i < count_; ++i) {
+            auto &queued = msgs_[(head_ + i) % kCapacity];
+            if (queued.type != msg.type ||
+                (msg.type == Message::kTimerTimeout &&
+                 queued.arg.timer.value != msg.arg.timer.value)) {
+                continue;
+            }
+            queued = msg;  // the task sees the latest timeout
+            ++coalesced_;
+            return MAKE_ERROR(Error::kSuccess);
+        }
+    }
+
+    if (count_ == kCapacity) {
+        ++dropped_;
+        return MAKE_ERROR(Error::kFull);
+    }
+    msgs_[(head_ + count_) % kCapacity] = msg;
+    ++count_;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+std::optional<Message> InterruptMessageRing::Pop() {
+    if (count_ == 0) {
+        return std::nullopt;
+    }
+    auto m = msgs_[head_];
+    head_ = (head_ + 1) % kCapacity;
+    --count_;
+    return m;
+}
+
+void InterruptMessageRing::Clear() {
+    head_ = count_ = 0;
+    dropped_ = coalesced_ = 0;
+}
+
+void TaskQueue::PushBack(Task *task) {
+    task->run_next_ = nullptr;
+    task->run_prev_ = tail_;
+    if (tail_) {
+        tail_->run_next_ = task;
+    } else {
+        head_ = task;
+    }
+    tail_ = task;
+    ++size_;
+}
+
+void TaskQueue::PushFront(Task *task) {
+    task->run_prev_ = nullptr;
+    task->run_next_ = head_;
+    if (head_) {
+        head_->run_prev_ = task;
+    } else {
+        tail_ = task;
+    }
+    head_ = task;
+    ++size_;
+}
+
+Task *TaskQueue::PopFront() {
+    auto task = head_;
+    if (task) {
+        Remove(task);
+    }
+    return task;
+}
+
+void TaskQueue::Remove(Task *task) {
+    if (task->run_prev_) {
+        task->run_prev_->run_next_ = task->run_next_;
+    } else if (head_ == task) {
+        head_ = task->run_next_;
+    } else {
+        return;  // not in this queue
+    }
+    if (task->run_next_) {
+        task->run_next_->run_prev_ = task->run_prev_;
+    } else {
+        tail_ = task->run_prev_;
+    }
+    task->run_next_ = task->run_prev_ = nullptr;
+    --size_;
+}
+
+Task::Task() { AllocateResources(); }
+
+Task::~Task() {
+    Release();
+    if (stack_) {
+        memory_manager->Free(
+            FrameID{reinterpret_cast<uintptr_t>(stack_) / kBytesPerFrame},
+            kDefaultStackBytes / kBytesPerFrame);
+    }
+    FreeFPUArea(context_.xsave_area);
+}
+
+Error Task::AllocateResources() {
+    if (stack_ == nullptr) {
+        const auto stack_frames = kDefaultStackBytes / kBytesPerFrame;
+        auto [frame, err] = memory_manager->Allocate(stack_frames);
+        if (err) {
+            return err;
+        }
+        stack_ = reinterpret_cast<uint64_t *>(frame.Frame());
+    }
+    if (context_.xsave_area == nullptr) {
+        context_.xsave_area = AllocateFPUArea();
+        if (context_.xsave_area == nullptr) {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Task &Task::Init(uint64_t id) {
+    id_ = id;
+    ClearContext();
+    name_[0] = '\0';
+    command_[0] = '\0';
+    arg_[0] = '\0';
+    level_ = kDefaultLevel;
+    cpu_ = -1;
+    ipc_partner_ = 0;
+    running_ = false;
+    wait_src_ = 0;
+    dpaging_begin_ = dpaging_end_ = 0;
+    ClearFileMappings();
+    image_ = nullptr;
+    run_next_ = run_prev_ = nullptr;
+    irq_msgs_.Clear();
+    name_indexed_ = false;
+    waiting_message_ = false;
+    return *this;
+}
+
+void Task::Release() {
+    while (auto node = msgs_.Pop()) {
+        message_cache.Free(node);
+    }
+    buf_.Resize(0);
+    ClearFileMappings();
+}
+
+void Task::SetName(const char *name) {
+    SpinLockGuard guard{task_lock};
+    task_manager->SetTaskName(this, name);
+}
 
 Task &Task::InitContext(TaskFunc *f, int64_t data) {
     const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
     uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
 
-    memset(&context_, 0, sizeof(context_));
+    ClearContext();
     context_.cr3 = GetCR3();
     context_.rflags = 0x202;
     context_.cs = kKernelCS;
@@ -35,11 +289,21 @@ Task &Task::InitContext(TaskFunc *f, int64_t data) {
     context_.rdi = id_;
     context_.rsi = data;
 
-    *reinterpret_cast<uint32_t *>(&context_.fxsave_area[24]) = 0x1f80;
+    *reinterpret_cast<uint32_t *>(&context_.xsave_area[24]) = 0x1f80;
 
     return *this;
 }
 
+void Task::ClearContext() {
+    // XRSTOR faults on a header left over from an earlier use
+    uint8_t *xsave_area = context_.xsave_area;
+    memset(&context_, 0, sizeof(context_));
+    context_.xsave_area = xsave_area;
+    if (xsave_area) {
+        memset(xsave_area, 0, fpu_area_size);
+    }
+}
+
 TaskContext &Task::Context() { return context_; }
 
 uint64_t &Task::OSStackPointer() { return os_stack_ptr_; }
@@ -51,23 +315,79 @@ Task &Task::Sleep() {
     return *this;
 }
 
+Task &Task::WaitMessage(uint64_t src) {
+    waiting_message_ = true;
+    wait_src_ = src;
+    task_manager->Sleep(this);
+    waiting_message_ = false;
+    wait_src_ = 0;
+    return *this;
+}
+
 Task &Task::Wakeup() {
     task_manager->Wakeup(this);
     return *this;
 }
 
-void Task::SendMessage(const Message &msg) {
-    msgs_.push_back(msg);
+Error Task::SendMessage(const Message &msg) {
+    return SendMessages(&msg, 1).error;
+}
+
+WithError<size_t> Task::SendMessages(const Message *msgs, size_t n) {
+    size_t sent = 0;
+    bool wakeup = false;
+    for (; sent < n; ++sent) {
+        auto node = reinterpret_cast<MessageNode *>(message_cache.Allocate());
+        if (node == nullptr) {
+            break;
+        }
+        node->deferred = false;
+        node->msg = msgs[sent];
+        msgs_.Push(node);
+        // a closed receiver would only go back to sleep
+        wakeup |= wait_src_ == 0 || wait_src_ == msgs[sent].src_task;
+    }
+    ipc_stat.sent += sent;
+    if (wakeup) {
+        Wakeup();
+    }
+    if (sent < n) {
+        return {sent, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    return {sent, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error Task::PostMessage(const Message &msg, bool merge) {
+    if (auto err = irq_msgs_.Push(msg, merge)) {
+        return err;
+    }
     Wakeup();
+    return MAKE_ERROR(Error::kSuccess);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-    if (msgs_.empty()) {
+    if (auto m = irq_msgs_.Pop()) {
+        return m;
+    }
+
+    auto node = msgs_.Pop();
+    if (node == nullptr) {
+        return std::nullopt;
+    }
+
+    auto m = node->msg;
+    message_cache.Free(node);
+    return m;
+}
+
+std::optional<Message> Task::ReceiveMessageFrom(uint64_t src) {
+    auto node = msgs_.PopFrom(src, ipc_stat.deferred);
+    if (node == nullptr) {
         return std::nullopt;
     }
 
-    auto m = msgs_.front();
-    msgs_.pop_front();
+    auto m = node->msg;
+    message_cache.Free(node);
     return m;
 }
 
@@ -79,27 +399,130 @@ uint64_t Task::DPagingEnd() const { return dpaging_end_; }
 
 void Task::SetDPagingEnd(uint64_t v) { dpaging_end_ = v; }
 
+Error Task::ReserveFileMappings(size_t num_mappings) {
+    ClearFileMappings();
+    if (num_mappings == 0) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    file_mappings_ = new (std::nothrow) FileMapping[num_mappings];
+    if (file_mappings_ == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    file_mapping_capacity_ = num_mappings;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Task::AddFileMapping(const FileMapping &mapping) {
+    if (file_mapping_count_ == file_mapping_capacity_) {
+        return MAKE_ERROR(Error::kFull);
+    }
+    file_mappings_[file_mapping_count_++] = mapping;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void Task::ClearFileMappings() {
+    delete[] file_mappings_;
+    file_mappings_ = nullptr;
+    file_mapping_capacity_ = 0;
+    file_mapping_count_ = 0;
+}
+
 TaskManager::TaskManager() {
-    Task &task = NewTask().SetLevel(current_level_).SetRunning(true);
-    running_[current_level_].push_back(&task);
+    auto &queue = cpus_[0];
+    queue.current_level = kMaxLevel;
+
+    Task &task = NewTask()->SetLevel(kMaxLevel).SetRunning(true);
+    task.cpu_ = 0;
+    queue.running[kMaxLevel].PushBack(&task);
 
     Task &idle =
-        NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
-    running_[0].push_back(&idle);
+        NewTask()->InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
+    idle.cpu_ = 0;
+    queue.running[0].PushBack(&idle);
 }
 
-Task &TaskManager::NewTask() {
-    ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
+Task *TaskManager::NewTask() {
+    // IDs keep increasing; skip the ones whose slot is still taken by a
+    // long-lived task
+    for (size_t i = 0; i < kMaxTasks; ++i) {
+        ++latest_id_;
+        if (tasks_[latest_id_ % kMaxTasks] != nullptr) {
+            continue;
+        }
+
+        Task *task = task_cache.Allocate();
+        if (task == nullptr) {
+            return nullptr;
+        }
+        // the constructor may have run out of memory
+        if (auto err = task->AllocateResources()) {
+            Log(kError, "failed to allocate task resources: %s\n",
+                err.Name());
+            task_cache.Free(task);
+            return nullptr;
+        }
+        tasks_[latest_id_ % kMaxTasks] = &task->Init(latest_id_);
+        return task;
+    }
+    return nullptr;
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx) {
-    TaskContext &task_ctx = task_manager->CurrentTask().Context();
-    memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+    task_lock.Acquire();
+    TaskContext &task_ctx = CurrentTask().Context();
+    // the interrupt handler saved the FPU state in an area on its stack
+    memcpy(&task_ctx, &current_ctx, offsetof(TaskContext, xsave_area));
+    memcpy(task_ctx.xsave_area, current_ctx.xsave_area, fpu_area_size);
     Task *current_task = RotateCurrentRunQueue(false);
     if (&CurrentTask() != current_task) {
         RestoreContext(&CurrentTask().Context());
     }
+    task_lock.Release();
+}
+
+void TaskManager::StartCPU(int cpu) {
+    task_lock.Lock();
+    Task *idle = NewTask();
+    if (idle == nullptr) {
+        task_lock.Unlock();
+        Log(kError, "no idle task for CPU %d\n", cpu);
+        while (true) __asm__("hlt");
+    }
+    idle->InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
+    idle->cpu_ = cpu;
+
+    // tasks may have been queued here before the idle task existed
+    auto &queue = cpus_[cpu];
+    queue.running[0].PushBack(idle);
+    for (int lv = kMaxLevel; lv >= 0; --lv) {
+        if (!queue.running[lv].Empty()) {
+            queue.current_level = lv;
+            break;
+        }
+    }
+    queue.level_changed = false;
+    RestoreContext(&CurrentTask().Context());
+    __builtin_unreachable();
+}
+
+void TaskManager::FinishSwitch() {
+    const int cpu = CurrentCPU();
+    auto &queue = cpus_[cpu];
+    if (auto task = queue.finished) {
+        queue.finished = nullptr;
+        task_cache.Free(task);
+    }
+
+    if (queue.switch_start) {
+        queue.switch_cycles += __builtin_ia32_rdtsc() - queue.switch_start;
+        ++queue.switches;
+        queue.switch_start = 0;
+    }
+
+    CPUData(cpu).os_stack_ptr = &CurrentTask().OSStackPointer();
+
+    UpdateLAPICTimer(queue.current_level == 0);
+    task_lock.Release();
 }
 
 void TaskManager::Sleep(Task *task) {
@@ -109,23 +532,30 @@ void TaskManager::Sleep(Task *task) {
 
     task->SetRunning(false);
 
-    if (task == running_[current_level_].front()) {
+    if (task == &CurrentTask()) {
         Task *current_task = RotateCurrentRunQueue(true);
+        cpus_[CurrentCPU()].switch_start = __builtin_ia32_rdtsc();
         SwitchContext(&CurrentTask().Context(), &current_task->Context());
+        task_lock.Acquire();
         return;
     }
 
-    Erase(running_[task->Level()], task);
+    auto &queue = cpus_[task->cpu_];
+    if (task == queue.running[queue.current_level].Front()) {
+        // running on another CPU; it leaves the queue at the next switch
+        SendRescheduleIPI(task->cpu_);
+        return;
+    }
+    queue.running[task->Level()].Remove(task);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    Sleep(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -139,122 +569,266 @@ void TaskManager::Wakeup(Task *task, int level) {
         level = task->Level();
     }
 
+    if (task->cpu_ < 0) {
+        task->cpu_ = next_cpu_;
+        next_cpu_ = (next_cpu_ + 1) % CPUCount();
+    }
+    auto &queue = cpus_[task->cpu_];
+    if (task == queue.running[queue.current_level].Front()) {
+        // put to sleep from here but not yet switched away from
+        task->SetRunning(true);
+        return;
+    }
+
     task->SetLevel(level);
     task->SetRunning(true);
 
-    running_[level].push_back(task);
-    if (level > current_level_) {
-        level_changed_ = true;
+    queue.running[level].PushBack(task);
+    if (level > queue.current_level) {
+        queue.level_changed = true;
+        // an idle CPU has no timer interrupt coming, even if it is this one
+        if (task->cpu_ != CurrentCPU() || queue.current_level == 0) {
+            SendRescheduleIPI(task->cpu_);
+        }
+    } else if (Waiting(queue) > 1 || !NearPartner(task, task->cpu_)) {
+        // StealTask would take it; idle CPUs only look when woken up
+        KickIdleCPU(task->cpu_);
     }
-    return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Wakeup(it->get(), level);
+    Wakeup(task, level);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message &msg) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
-    return MAKE_ERROR(Error::kSuccess);
+    return task->SendMessage(msg);
 }
 
-Task &TaskManager::CurrentTask() { return *running_[current_level_].front(); }
+Error TaskManager::PostMessage(uint64_t id, const Message &msg,
+                               bool merge) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
 
-uint64_t TaskManager::FindTask(const char *name) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), [name](const auto &t) {
-        return t->GetName() == name;
-    });
+    return task->PostMessage(msg, merge);
+}
+
+Error TaskManager::HandoffMessage(uint64_t id, const Message &msg) {
+    return HandoffMessages(id, &msg, 1).error;
+}
+
+WithError<size_t> TaskManager::HandoffMessages(uint64_t id,
+                                               const Message *msgs, size_t n) {
+    Task *receiver = FindTask(id);
+    if (receiver == nullptr) {
+        return {0, MAKE_ERROR(Error::kNoSuchTask)};
+    }
+    if (n == 0) {
+        return {0, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    const bool blocked =
+        receiver->WaitingMessageFrom(msgs[0].src_task) && !receiver->Running();
+    const int cpu = CurrentCPU();
+    auto &queue = cpus_[cpu];
+    Task *sender = &CurrentTask();
+    // pull a blocked receiver over so the sender can hand it the CPU, but
+    // only while nothing else waits here; balancing spreads them otherwise
+    if (blocked && receiver->cpu_ >= 0 && receiver->cpu_ != cpu &&
+        Waiting(queue) == 0) {
+        receiver->cpu_ = cpu;
+        ++queue.affine_wakeups;
+    }
 
-    if (it == tasks_.end()) {
-        return 0;
+    auto [sent, err] = receiver->SendMessages(msgs, n);
+    if (sent == 0) {
+        return {0, err};
     }
+    sender->ipc_partner_ = receiver->ID();
+    receiver->ipc_partner_ = sender->ID();
 
-    return (*it)->ID();
+    // a receiver on another CPU has just been woken up there
+    if (!blocked || receiver == sender || receiver->cpu_ != cpu ||
+        receiver->Level() < queue.current_level) {
+        return {sent, err};
+    }
+
+    // run the receiver now and keep the sender right behind it, so a reply
+    // comes back without waiting for a full rotation of the run queue
+    auto &level_queue = queue.running[receiver->Level()];
+    level_queue.Remove(receiver);
+    level_queue.PushFront(receiver);
+    queue.current_level = receiver->Level();
+    ++ipc_stat.handoffs;
+    queue.switch_start = __builtin_ia32_rdtsc();
+    SwitchContext(&receiver->Context(), &sender->Context());
+    task_lock.Acquire();
+    return {sent, err};
+}
+
+Task &TaskManager::CurrentTask() {
+    auto &queue = cpus_[CurrentCPU()];
+    return *queue.running[queue.current_level].Front();
+}
+
+CPUStat TaskManager::GetCPUStat() const {
+    static_assert(kMaxCPUs <= kCPUStatCount);
+    CPUStat stat{};
+    stat.cpus = CPUCount();
+    for (size_t i = 0; i < stat.cpus; ++i) {
+        const auto &queue = cpus_[i];
+        auto &entry = stat.cpu[i];
+        const auto timer = GetLAPICTimerStat(i);
+        entry.busy_ticks = timer.busy_ticks;
+        entry.idle_ticks = timer.idle_ticks;
+        entry.timer_interrupts = timer.interrupts;
+        entry.queued = Waiting(queue);
+        entry.steals = queue.steals;
+        entry.stolen = queue.stolen;
+        entry.affine_wakeups = queue.affine_wakeups;
+        entry.switches = queue.switches;
+        entry.switch_cycles = queue.switch_cycles;
+    }
+    return stat;
+}
+
+bool TaskManager::Idle() {
+    // only the idle task runs at level 0
+    return cpus_[CurrentCPU()].current_level == 0;
+}
+
+IPCStat TaskManager::GetIPCStat() const {
+    IPCStat stat = ipc_stat;
+    for (auto task : tasks_) {
+        if (task) {
+            stat.irq_dropped += task->irq_msgs_.Dropped();
+            stat.irq_coalesced += task->irq_msgs_.Coalesced();
+        }
+    }
+    return stat;
+}
+
+uint64_t TaskManager::FindTask(const char *name) {
+    const auto hash = NameHash(name);
+    for (Task *t = names_[hash % kNameBuckets]; t != nullptr;
+         t = t->name_next_) {
+        if (t->name_hash_ == hash && strcmp(t->name_, name) == 0) {
+            return t->ID();
+        }
+    }
+    return 0;
 }
 
 Task *TaskManager::FindTask(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
+    Task *task = tasks_[id % kMaxTasks];
+    return task && task->ID() == id ? task : nullptr;
+}
+
+void TaskManager::SetTaskName(Task *task, const char *name) {
+    RemoveName(task);
+    strncpy(task->name_, name, Task::kMaxNameLength - 1);
+    task->name_[Task::kMaxNameLength - 1] = '\0';
+    if (task->name_[0] == '\0') {
+        return;
+    }
 
-    return it->get();
+    // append so that the oldest task wins when names collide
+    task->name_hash_ = NameHash(task->name_);
+    task->name_next_ = nullptr;
+    Task **next = &names_[task->name_hash_ % kNameBuckets];
+    while (*next) {
+        next = &(*next)->name_next_;
+    }
+    *next = task;
+    task->name_indexed_ = true;
+}
+
+void TaskManager::RemoveName(Task *task) {
+    if (!task->name_indexed_) {
+        return;
+    }
+    Task **next = &names_[task->name_hash_ % kNameBuckets];
+    while (*next != task) {
+        next = &(*next)->name_next_;
+    }
+    *next = task->name_next_;
+    task->name_indexed_ = false;
 }
 
 Error TaskManager::ExpandTaskBuffer(uint64_t id, uint32_t bytes) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
-    (*it)->buf_.resize(bytes);
-
-    return MAKE_ERROR(Error::kSuccess);
+    return task->buf_.Resize(bytes);
 }
 
 int TaskManager::CopyToTaskBuffer(uint64_t id, void *buf, size_t offset,
                                   size_t len) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return -1;
     }
 
-    int remain_bytes = (*it)->buf_.size() - (offset + len);
+    int remain_bytes = task->buf_.Size() - (offset + len);
     if (remain_bytes < 0) {
         return -1;
     }
-    memcpy(&(*it)->buf_[offset], buf, len);
+    memcpy(&task->buf_[offset], buf, len);
 
     return remain_bytes;
 }
 
 Error TaskManager::StartAppTask(uint64_t id, uint64_t am_id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
-    (*it)->InitContext(TaskApp, am_id).Wakeup();
+    task->InitContext(TaskApp, am_id).Wakeup();
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::StartServerTask(uint64_t id, uint64_t init_id) {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                           [id](const auto &t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
-    (*it)->InitContext(TaskServer, init_id).Wakeup();
+    task->InitContext(TaskServer, init_id).Wakeup();
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Finish(int exit_code) {
+    task_lock.Lock();
     Task *current_task = RotateCurrentRunQueue(true);
 
     const auto task_id = current_task->ID();
-    auto it = std::find_if(
-        tasks_.begin(), tasks_.end(),
-        [current_task](const auto &t) { return t.get() == current_task; });
-
-    tasks_.erase(it);
-
-    finish_tasks_[task_id] = exit_code;
-    if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
-        auto waiter = it->second;
-        finish_waiter_.erase(it);
-        Wakeup(waiter);
+    tasks_[task_id % kMaxTasks] = nullptr;
+    RemoveName(current_task);
+
+    // still running on its stack; FinishSwitch frees the object once
+    // RestoreContext has left it
+    current_task->Release();
+    cpus_[CurrentCPU()].finished = current_task;
+
+    if (auto record = FindFinishRecord(task_id, true)) {
+        record->exit_code = exit_code;
+        record->finished = true;
+        if (auto waiter = record->waiter) {
+            record->waiter = nullptr;
+            Wakeup(waiter);
+        }
     }
 
     RestoreContext(&CurrentTask().Context());
@@ -265,26 +839,31 @@ void TaskManager::ChangeLevelRunning(Task *task, int level) {
         return;
     }
 
-    if (task != running_[current_level_].front()) {
+    auto &queue = cpus_[task->cpu_];
+    if (task != queue.running[queue.current_level].Front()) {
         // change level of other task
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
+        queue.running[task->Level()].Remove(task);
+        queue.running[level].PushBack(task);
         task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
+        if (level > queue.current_level) {
+            queue.level_changed = true;
         }
         return;
     }
+    if (task->cpu_ != CurrentCPU()) {
+        // the level of a task running on another CPU is left as it is
+        return;
+    }
 
     // change level myself
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
+    queue.running[queue.current_level].PopFront();
+    queue.running[level].PushFront(task);
     task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
+    if (level >= queue.current_level) {
+        queue.current_level = level;
     } else {
-        current_level_ = level;
-        level_changed_ = true;
+        queue.current_level = level;
+        queue.level_changed = true;
     }
 }
 
@@ -292,53 +871,158 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
     int exit_code;
     Task *current_task = &CurrentTask();
     while (true) {
-        if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
-            exit_code = it->second;
-            finish_tasks_.erase(it);
+        auto record = FindFinishRecord(task_id, true);
+        if (record == nullptr) {
+            return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+        }
+        if (record->finished) {
+            exit_code = record->exit_code;
+            FinishRecord **prev = &finish_records_;
+            while (*prev != record) {
+                prev = &(*prev)->next;
+            }
+            *prev = record->next;
+            finish_record_cache.Free(record);
             break;
         }
-        finish_waiter_[task_id] = current_task;
+        record->waiter = current_task;
         Sleep(current_task);
     }
     return {exit_code, MAKE_ERROR(Error::kSuccess)};
 }
 
+TaskManager::FinishRecord *TaskManager::FindFinishRecord(uint64_t task_id,
+                                                         bool create) {
+    for (auto r = finish_records_; r != nullptr; r = r->next) {
+        if (r->task_id == task_id) {
+            return r;
+        }
+    }
+    if (!create) {
+        return nullptr;
+    }
+
+    auto r = reinterpret_cast<FinishRecord *>(finish_record_cache.Allocate());
+    if (r == nullptr) {
+        return nullptr;
+    }
+    *r = {finish_records_, task_id, 0, false, nullptr};
+    finish_records_ = r;
+    return r;
+}
+
 Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-    auto &level_queue = running_[current_level_];
-    Task *current_task = level_queue.front();
-    level_queue.pop_front();
-    if (!current_sleep) {
-        level_queue.push_back(current_task);
+    auto &queue = cpus_[CurrentCPU()];
+    auto &level_queue = queue.running[queue.current_level];
+    Task *current_task = level_queue.PopFront();
+    // a task put to sleep from another CPU leaves the queue here
+    if (!current_sleep && current_task->Running()) {
+        level_queue.PushBack(current_task);
     }
-    if (level_queue.empty()) {
-        level_changed_ = true;
+    if (level_queue.Empty()) {
+        queue.level_changed = true;
     }
 
-    if (level_changed_) {
-        level_changed_ = false;
+    if (queue.level_changed) {
+        queue.level_changed = false;
         for (int lv = kMaxLevel; lv >= 0; --lv) {
-            if (!running_[lv].empty()) {
-                current_level_ = lv;
+            if (!queue.running[lv].Empty()) {
+                queue.current_level = lv;
                 break;
             }
         }
     }
 
+    // about to go idle; an idle CPU also comes here when KickIdleCPU wakes it
+    if (queue.current_level == 0) {
+        if (Task *task = StealTask(CurrentCPU())) {
+            queue.running[task->Level()].PushBack(task);
+            queue.current_level = task->Level();
+        }
+    }
+
     return current_task;
 }
 
+size_t TaskManager::Waiting(const CPUQueue &queue) {
+    size_t waiting = 0;
+    for (int lv = 1; lv <= kMaxLevel; ++lv) {
+        waiting += queue.running[lv].Size();
+    }
+    if (queue.current_level > 0 && waiting > 0) {
+        --waiting;
+    }
+    return waiting;
+}
+
+Task *TaskManager::StealTask(int thief) {
+    int victim = -1;
+    size_t most = 0;
+    for (int cpu = 0; cpu < CPUCount(); ++cpu) {
+        if (cpu == thief) {
+            continue;
+        }
+        if (const auto waiting = Waiting(cpus_[cpu]); waiting > most) {
+            victim = cpu;
+            most = waiting;
+        }
+    }
+    if (victim < 0) {
+        return nullptr;
+    }
+
+    auto &from = cpus_[victim];
+    Task *running = from.running[from.current_level].Front();
+    for (int lv = kMaxLevel; lv > 0; --lv) {
+        Task *bound = nullptr;
+        Task *task = nullptr;
+        // start at the tail, where the task that ran least recently waits
+        for (Task *t = from.running[lv].Back(); t; t = t->run_prev_) {
+            if (t == running) {
+                continue;
+            }
+            if (!NearPartner(t, victim)) {
+                task = t;
+                break;
+            }
+            if (bound == nullptr) {
+                bound = t;
+            }
+        }
+        if (task == nullptr && most > 1) {
+            task = bound;
+        }
+        if (task) {
+            from.running[lv].Remove(task);
+            ++from.stolen;
+            ++cpus_[thief].steals;
+            task->cpu_ = thief;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void TaskManager::KickIdleCPU(int busy) {
+    for (int cpu = 0; cpu < CPUCount(); ++cpu) {
+        if (cpu != busy && cpus_[cpu].current_level == 0) {
+            SendRescheduleIPI(cpu);
+            return;
+        }
+    }
+}
+
+bool TaskManager::NearPartner(const Task *task, int cpu) {
+    const Task *partner = FindTask(task->ipc_partner_);
+    return partner && partner->cpu_ == cpu;
+}
+
 TaskManager *task_manager;
 
-void InitializeTask() {
-    task_manager = new TaskManager;
+void InitializeTask() { task_manager = new TaskManager; }
 
-    __asm__("cli");
-    timer_manager->AddTimer(Timer{
-        timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
-    __asm__("sti");
+extern "C" uint64_t GetCurrentSwitchStack() {
+    return reinterpret_cast<uint64_t>(switch_stacks[CurrentCPU()].end());
 }
 
-__attribute__((no_caller_saved_registers)) extern "C" uint64_t
-GetCurrentTaskOSStackPointer() {
-    return task_manager->CurrentTask().OSStackPointer();
-}
\ No newline at end of file
+extern "C" void FinishContextSwitch() { task_manager->FinishSwitch(); }
\ No newline at end of file
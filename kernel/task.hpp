@@ -3,68 +3,220 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
-#include <deque>
-#include <map>
 #include <optional>
-#include <string>
 #include <vector>
 
 #include "../libs/common/message.hpp"
+#include "../libs/common/stat.hpp"
 #include "error.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 struct TaskContext {
     uint64_t cr3, rip, rflags, reserved1;             // offset 0x00
     uint64_t cs, ss, fs, gs;                          // offset 0x20
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp;  // offset 0x40
     uint64_t r8, r9, r10, r11, r12, r13, r14, r15;    // offset 0x80
-    std::array<uint8_t, 512> fxsave_area;             // offset 0xc0
+    // fpu_area_size bytes for XSAVE, 64-byte aligned; owned by the Task
+    uint8_t* xsave_area;                              // offset 0xc0
 } __attribute__((packed));
 
 using TaskFunc = void(uint64_t, int64_t);
 
+class Task;
 class TaskManager;
+struct ExecImage;
+
+/** @brief buffer for the executable image of a task, backed by frames */
+class TaskBuffer {
+   public:
+    TaskBuffer() = default;
+    TaskBuffer(const TaskBuffer&) = delete;
+    TaskBuffer& operator=(const TaskBuffer&) = delete;
+    ~TaskBuffer();
+
+    Error Resize(size_t bytes);
+    size_t Size() const { return bytes_; }
+    uint8_t& operator[](size_t i) { return data_[i]; }
+
+   private:
+    uint8_t* data_{nullptr};
+    size_t bytes_{0};
+    size_t frames_{0};
+};
+
+struct MessageNode {
+    MessageNode* next;
+    bool deferred;  // skipped over by a closed receive at least once
+    Message msg;
+};
+
+/** @brief FIFO of messages linked through slab-allocated nodes */
+class MessageQueue {
+   public:
+    bool Empty() const { return head_ == nullptr; }
+    void Push(MessageNode* node);
+    MessageNode* Pop();
+    /** @brief removes the first message from src
+     *
+     * Messages in front of it stay queued in order. Those skipped for the
+     * first time are marked deferred and counted in newly_deferred.
+     */
+    MessageNode* PopFrom(uint64_t src, uint64_t& newly_deferred);
+
+   private:
+    MessageNode* head_{nullptr};
+    MessageNode* tail_{nullptr};
+};
+
+/** @brief fixed-capacity message ring filled from interrupt handlers
+ *
+ * Never allocates. Notifications that only say "something happened"
+ * (kInterruptXHCI) are merged into one pending message, as are timeouts
+ * pushed with merge, e.g. of a periodic timer; anything else that does not
+ * fit is dropped. Both cases are counted.
+ */
+class InterruptMessageRing {
+   public:
+    static const size_t kCapacity = 16;
+
+    bool Empty() const { return count_ == 0; }
+    Error Push(const Message& msg, bool merge = false);
+    std::optional<Message> Pop();
+    void Clear();
+
+    uint64_t Dropped() const { return dropped_; }
+    uint64_t Coalesced() const { return coalesced_; }
+
+   private:
+    std::array<Message, kCapacity> msgs_;
+    size_t head_{0}, count_{0};
+    uint64_t dropped_{0}, coalesced_{0};
+};
+
+/** @brief run queue linked through the tasks themselves */
+class TaskQueue {
+   public:
+    bool Empty() const { return head_ == nullptr; }
+    Task* Front() const { return head_; }
+    Task* Back() const { return tail_; }
+    size_t Size() const { return size_; }
+    void PushBack(Task* task);
+    void PushFront(Task* task);
+    Task* PopFront();
+    void Remove(Task* task);
+
+   private:
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
+    size_t size_{0};
+};
 
 class Task {
    public:
     static const int kDefaultLevel = 1;
     static const size_t kDefaultStackBytes = 8 * 4096;
+    static const size_t kMaxNameLength = 32;
 
-    std::vector<uint8_t> buf_;
+    TaskBuffer buf_;
     char command_[32];  // use for application
     char arg_[32];      // use for application
 
-    Task(uint64_t id);
+    // Task objects are cached by TaskManager; the constructor only sets up
+    // what survives reuse (the kernel stack and FPU area), Init prepares a
+    // new task.
+    Task();
+    ~Task();
+    /** @brief allocates the kernel stack and FPU area the task still lacks */
+    Error AllocateResources();
+    Task& Init(uint64_t id);
     Task& InitContext(TaskFunc* f, int64_t data);
     TaskContext& Context();
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
+    /** @brief Sleep until a message arrives; lets senders switch to us
+     *
+     * With src != 0 only a message from task src wakes the task up.
+     */
+    Task& WaitMessage(uint64_t src = 0);
     Task& Wakeup();
-    void SendMessage(const Message& msg);
+    Error SendMessage(const Message& msg);
+    /** @brief queues msgs in order and wakes the task at most once
+     *
+     * Returns how many messages were queued before running out of memory.
+     */
+    WithError<size_t> SendMessages(const Message* msgs, size_t n);
+    /** @brief SendMessage for interrupt context; uses the preallocated ring
+     *
+     * With merge, a timeout replaces a queued one of the same timer value.
+     */
+    Error PostMessage(const Message& msg, bool merge = false);
     std::optional<Message> ReceiveMessage();
+    /** @brief receives only from task src, leaving other messages queued */
+    std::optional<Message> ReceiveMessageFrom(uint64_t src);
+    const InterruptMessageRing& InterruptMessages() const {
+        return irq_msgs_;
+    }
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
     uint64_t DPagingEnd() const;
     void SetDPagingEnd(uint64_t v);
+    /** @brief drops the file mappings and makes room for num_mappings */
+    Error ReserveFileMappings(size_t num_mappings);
+    /** @brief kFull if the reserved room is used up */
+    Error AddFileMapping(const FileMapping& mapping);
+    void ClearFileMappings();
+    size_t FileMappingCount() const { return file_mapping_count_; }
+    const FileMapping& GetFileMapping(size_t i) const {
+        return file_mappings_[i];
+    }
+    /** @brief executable the file mappings come from */
+    ExecImage* Image() const { return image_; }
+    void SetImage(ExecImage* image) { image_ = image; }
 
     int Level() const { return level_; }
+    /** @brief CPU whose run queue the task is on; -1 until first woken */
+    int CPU() const { return cpu_; }
     bool Running() const { return running_; }
+    bool WaitingMessage() const { return waiting_message_; }
+    bool WaitingMessageFrom(uint64_t src) const {
+        return waiting_message_ && (wait_src_ == 0 || wait_src_ == src);
+    }
 
-    void SetName(char* name) { name_ = name; }
-    std::string GetName() { return name_; }
+    void SetName(const char* name);
+    const char* GetName() const { return name_; }
 
    private:
-    uint64_t id_;
-    std::string name_;
+    uint64_t id_{0};
+    char name_[kMaxNameLength]{};
 
-    std::vector<uint64_t> stack_;
-    alignas(16) TaskContext context_;
+    uint64_t* stack_{nullptr};
+    TaskContext context_{};
     uint64_t os_stack_ptr_;
-    std::deque<Message> msgs_;
+    MessageQueue msgs_;
+    InterruptMessageRing irq_msgs_;
     unsigned int level_{kDefaultLevel};
+    int cpu_{-1};
+    uint64_t ipc_partner_{0};  // last task a message was handed off with
     bool running_{false};
+    bool waiting_message_{false};
+    uint64_t wait_src_{0};
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
+    FileMapping* file_mappings_{nullptr};
+    size_t file_mapping_capacity_{0};
+    size_t file_mapping_count_{0};
+    ExecImage* image_{nullptr};
+    Task* run_next_{nullptr};
+    Task* run_prev_{nullptr};
+    uint32_t name_hash_{0};
+    bool name_indexed_{false};
+    Task* name_next_{nullptr};
+
+    void Release();
+    /** @brief zeroes the context, keeping its FPU area */
+    void ClearContext();
 
     Task& SetLevel(int level) {
         level_ = level;
@@ -76,22 +228,41 @@ class Task {
     }
 
     friend TaskManager;
+    friend TaskQueue;
 };
 
 class TaskManager {
    public:
     static const int kMaxLevel = 3;
+    static const size_t kMaxTasks = 1024;
+    static const size_t kNameBuckets = 64;
 
     TaskManager();
-    Task& NewTask();
+    /** @brief returns nullptr when no task slot or memory is left */
+    Task* NewTask();
     void SwitchTask(const TaskContext& current_ctx);
+    /** @brief gives an application processor an idle task and starts
+     * running its queue */
+    [[noreturn]] void StartCPU(int cpu);
+    /** @brief called by RestoreContext once the old stack is left behind */
+    void FinishSwitch();
 
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
     void Wakeup(Task* task, int level = -1);
     Error Wakeup(uint64_t id, int level = -1);
     Error SendMessage(uint64_t id, const Message& msg);
+    Error PostMessage(uint64_t id, const Message& msg, bool merge = false);
+    /** @brief SendMessage that switches straight to a receiver blocked in
+     * WaitMessage, donating the rest of the sender's time slice */
+    Error HandoffMessage(uint64_t id, const Message& msg);
+    WithError<size_t> HandoffMessages(uint64_t id, const Message* msgs,
+                                      size_t n);
     Task& CurrentTask();
+    IPCStat GetIPCStat() const;
+    CPUStat GetCPUStat() const;
+    /** @brief true while the running CPU has nothing but its idle task */
+    bool Idle();
 
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
@@ -99,6 +270,7 @@ class TaskManager {
     Task* FindTask(uint64_t id);
 
     uint64_t FindTask(const char* name);
+    void SetTaskName(Task* task, const char* name);
 
     Error ExpandTaskBuffer(uint64_t id, uint32_t bytes);
     int CopyToTaskBuffer(uint64_t id, void* buf, size_t offset, size_t len);
@@ -106,19 +278,64 @@ class TaskManager {
     Error StartAppTask(uint64_t id, uint64_t am_id);
     Error StartServerTask(uint64_t id, uint64_t init_id);
 
+    // exit status of a finished task, kept until WaitFinish picks it up
+    struct FinishRecord {
+        FinishRecord* next;
+        uint64_t task_id;
+        int exit_code;
+        bool finished;
+        Task* waiter;
+    };
+
    private:
-    std::vector<std::unique_ptr<Task>> tasks_{};
+    // a task with ID id lives in slot id % kMaxTasks
+    std::array<Task*, kMaxTasks> tasks_{};
+    std::array<Task*, kNameBuckets> names_{};
     uint64_t latest_id_{0};
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    int current_level_{kMaxLevel};
-    bool level_changed_{false};
-    std::map<uint64_t, int> finish_tasks_{};     // key: ID of a finished task
-    std::map<uint64_t, Task*> finish_waiter_{};  // key: ID of a finished task
+    FinishRecord* finish_records_{nullptr};
+
+    struct CPUQueue {
+        std::array<TaskQueue, kMaxLevel + 1> running{};
+        int current_level{0};
+        bool level_changed{false};
+        // task that called Finish, freed after the switch away from it
+        Task* finished{nullptr};
+
+        uint64_t steals{0}, stolen{0}, affine_wakeups{0};
+        // TSC when SwitchContext was entered, 0 for other switches
+        uint64_t switch_start{0};
+        uint64_t switches{0}, switch_cycles{0};
+    };
+    std::array<CPUQueue, kMaxCPUs> cpus_{};
+    int next_cpu_{0};
+
+    FinishRecord* FindFinishRecord(uint64_t task_id, bool create);
+    void RemoveName(Task* task);
 
     void ChangeLevelRunning(Task* task, int level);
     Task* RotateCurrentRunQueue(bool current_sleep);
+
+    /** @brief runnable tasks on a CPU other than the running one */
+    static size_t Waiting(const CPUQueue& queue);
+    /** @brief takes a waiting task from the busiest other CPU
+     *
+     * Higher levels go first. Within a level, a task whose IPC partner is on
+     * the same CPU stays there unless more than one task waits.
+     */
+    Task* StealTask(int thief);
+    /** @brief wakes an idle CPU other than busy so it can steal */
+    void KickIdleCPU(int busy);
+    bool NearPartner(const Task* task, int cpu);
 };
 
 extern TaskManager* task_manager;
 
+/** @brief protects TaskManager, the tasks and their message queues
+ *
+ * Code that switches tasks holds it across the switch: RestoreContext
+ * releases it after leaving the stack of the previous task, and a task
+ * resumed from SwitchContext takes it again before going on.
+ */
+extern SpinLock task_lock;
+
 void InitializeTask();
\ No newline at end of file
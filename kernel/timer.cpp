@@ -1,34 +1,168 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <limits>
+
 #include "acpi.hpp"
 #include "interrupt.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
+  SlabCache timer_cache{"timer", sizeof(TimerNode), alignof(TimerNode)};
+
   const uint32_t kCountMax = 0xffffffffu;
   volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  // the timer runs one-shot and is programmed again on every interrupt and
+  // task switch, so all times below are in timer counts
+  struct CPUTimer {
+    uint32_t programmed;  // initial count of the running one-shot
+    bool idle;
+    int64_t slice_left;   // until the running task is preempted
+    uint64_t busy_counts, idle_counts;
+    uint64_t interrupts;
+  };
+  std::array<CPUTimer, kMaxCPUs> cpu_timers{};
+  uint64_t counts_per_tick;
+  uint64_t slice_counts;
+  // counted by the BSP but not yet turned into ticks
+  uint64_t pending_counts;
+  int busy_cpus = 1;
+
+  // fixed-point factors with 32 fraction bits
+  uint64_t ns_per_tsc, counts_per_ns;
+  uint64_t tsc_base;
+
+  uint64_t Scale(uint64_t value, uint64_t factor) {
+    return (static_cast<unsigned __int128>(value) * factor) >> 32;
+  }
+
+  // takes what the one-shot has counted since it was programmed
+  void Advance(CPUTimer& t, int cpu) {
+    if (t.programmed == 0) {
+      return;
+    }
+    const uint64_t elapsed = t.programmed - current_count;
+    t.programmed = 0;
+    if (t.idle) {
+      t.idle_counts += elapsed;
+    } else {
+      t.busy_counts += elapsed;
+      t.slice_left -= elapsed;
+    }
+    if (cpu == 0) {
+      pending_counts += elapsed;
+    }
+  }
+
+  // A busy CPU needs an interrupt at the end of the slice and an idle one
+  // none until it is woken up. The BSP also keeps the tick count: it ticks
+  // while any CPU is busy, so the count they read is current, and otherwise
+  // sleeps until the next timer expires.
+  void Program(CPUTimer& t, int cpu) {
+    uint64_t interval = std::numeric_limits<uint64_t>::max();
+    if (!t.idle) {
+      interval = std::max<int64_t>(t.slice_left, 1);
+    }
+    if (cpu == 0 && pending_counts >= counts_per_tick) {
+      interval = 1;  // ticks are overdue
+    } else if (cpu == 0) {
+      const uint64_t to_tick = counts_per_tick - pending_counts;
+      if (!t.idle || __atomic_load_n(&busy_cpus, __ATOMIC_SEQ_CST) > 0) {
+        interval = std::min(interval, to_tick);
+      } else if (auto next = timer_manager->NextExpiry()) {
+        const auto ticks = *next - timer_manager->CurrentTick() - 1;
+        interval = std::min(interval, ticks * counts_per_tick + to_tick);
+      }
+    }
+    if (auto next = timer_manager->NextHRExpiry(cpu)) {
+      const uint64_t now = CurrentTimeNs();
+      // round up so that the timer has expired when the interrupt comes
+      const uint64_t counts =
+          *next > now ? Scale(*next - now, counts_per_ns) + 1 : 1;
+      interval = std::min(interval, counts);
+    }
+
+    // with nothing to wait for, the longest one-shot still keeps the busy
+    // and idle counts from wrapping
+    t.programmed = std::min<uint64_t>(interval, kCountMax);
+    initial_count = t.programmed;
+  }
 }
 
 void InitializeLAPICTimer() {
     timer_manager = new TimerManager;
 
     divide_config = 0b1011;
-    lvt_timer = (0b0010 << 16) | InterruptVector::kLAPICTimer;
-    
+    lvt_timer = InterruptVector::kLAPICTimer;
+
     StartLAPICTimer();
+    const uint64_t tsc_start = __builtin_ia32_rdtsc();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = __builtin_ia32_rdtsc();
     StopLAPICTimer();
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = (tsc_end - tsc_start) * 10;
+    // assumes an invariant TSC that all CPUs share, as on current hardware
+    // and QEMU
+    tsc_base = tsc_end;
+    ns_per_tsc = (1'000'000'000ul << 32) / tsc_freq;
+    counts_per_ns = (lapic_timer_freq << 32) / 1'000'000'000ul;
+    counts_per_tick = lapic_timer_freq / kTimerFreq;
+    slice_counts = counts_per_tick * kTaskTimerPeriod;
+
+    // application processors start idle
+    for (int cpu = 1; cpu < kMaxCPUs; ++cpu) {
+        cpu_timers[cpu].idle = true;
+    }
+    cpu_timers[0].slice_left = slice_counts;
+    Program(cpu_timers[0], 0);
+}
 
+void SetupLAPICTimer() {
     divide_config = 0b1011;
-    lvt_timer = (0b0010 << 16) | InterruptVector::kLAPICTimer;
-    initial_count = lapic_timer_freq / kTimerFreq;
+    lvt_timer = InterruptVector::kLAPICTimer;
+}
+
+void UpdateLAPICTimer(bool idle) {
+    const int cpu = CurrentCPU();
+    auto& t = cpu_timers[cpu];
+    Advance(t, cpu);
+
+    if (t.idle != idle) {
+        __atomic_store_n(&t.idle, idle, __ATOMIC_SEQ_CST);
+        if (idle) {
+            __atomic_sub_fetch(&busy_cpus, 1, __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_add_fetch(&busy_cpus, 1, __ATOMIC_SEQ_CST);
+            t.slice_left = slice_counts;
+            // the BSP may be asleep with a stale tick count
+            if (cpu != 0 && __atomic_load_n(&cpu_timers[0].idle,
+                                            __ATOMIC_SEQ_CST)) {
+                SendRescheduleIPI(0);
+            }
+        }
+    }
+    Program(t, cpu);
+}
 
+uint64_t CurrentTimeNs() {
+    return Scale(__builtin_ia32_rdtsc() - tsc_base, ns_per_tsc);
+}
+
+LAPICTimerStat GetLAPICTimerStat(int cpu) {
+    InterruptGuard guard;
+    const auto& t = cpu_timers[cpu];
+    return {t.busy_counts / counts_per_tick, t.idle_counts / counts_per_tick,
+            t.interrupts};
 }
 
 void StartLAPICTimer() {
@@ -43,54 +177,272 @@ void StopLAPICTimer() {
     initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
-    : timeout_{timeout}, value_{value}, task_id_{task_id} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id,
+             unsigned long period)
+    : timeout_{timeout}, value_{value}, task_id_{task_id}, period_{period} {
+}
+
+
+Error TimerManager::AddTimer(const Timer& timer) {
+    auto node = reinterpret_cast<TimerNode*>(timer_cache.Allocate());
+    if (node == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    node->timer = timer;
+
+    SpinLockGuard guard{lock_};
+    Insert(node);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TimerManager::AddHRTimer(const Timer& timer) {
+    auto node = reinterpret_cast<TimerNode*>(timer_cache.Allocate());
+    if (node == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    node->timer = timer;
+
+    // stay on this CPU until its LAPIC timer knows about the new timer
+    InterruptGuard guard;
+    auto& queue = hr_queues_[CurrentCPU()];
+    {
+        SpinLockGuard queue_guard{queue.lock};
+        InsertHR(queue, node);
+    }
+    if (queue.head == node) {
+        UpdateLAPICTimer(task_manager->Idle());
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t TimerManager::CancelTimer(uint64_t task_id, int value) {
+    TimerNode* canceled = nullptr;
+    size_t count = 0;
+    auto cancel = [&](TimerNode*& head, TimerNode*& tail) {
+        TimerNode* prev = nullptr;
+        TimerNode** next = &head;
+        while (TimerNode* node = *next) {
+            const auto& t = node->timer;
+            if (t.TaskID() != task_id || t.Value() != value) {
+                prev = node;
+                next = &node->next;
+                continue;
+            }
+            *next = node->next;
+            if (tail == node) {
+                tail = prev;
+            }
+            node->next = canceled;
+            canceled = node;
+            ++count;
+        }
+    };
+
+    {
+        SpinLockGuard guard{lock_};
+        for (auto& slot : slots_) {
+            cancel(slot.head, slot.tail);
+        }
+    }
+    for (auto& queue : hr_queues_) {
+        SpinLockGuard guard{queue.lock};
+        TimerNode* no_tail = nullptr;
+        cancel(queue.head, no_tail);
+    }
+
+    while (canceled) {
+        TimerNode* next = canceled->next;
+        timer_cache.Free(canceled);
+        canceled = next;
+    }
+    return count;
 }
 
+void TimerManager::Insert(TimerNode* node) {
+    // the slot of tick_ has been processed; base is the next one to be
+    const unsigned long base = tick_ + 1;
+    unsigned long expires = std::max(node->timer.Timeout(), base);
+    const unsigned long span = 1ul << (kWheelBits * kWheelLevels);
+    if (expires - base >= span) {
+        // parked in the farthest slot and placed again when it cascades
+        expires = base + span - 1;
+    }
+
+    int level = 0;
+    while (level < kWheelLevels - 1 &&
+           expires - base >= 1ul << (kWheelBits * (level + 1))) {
+        ++level;
+    }
+    const auto index = (expires >> (kWheelBits * level)) & (kWheelSlots - 1);
+    auto& slot = slots_[level * kWheelSlots + index];
 
-TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+    node->next = nullptr;
+    if (slot.tail) {
+        slot.tail->next = node;
+    } else {
+        slot.head = node;
     }
+    slot.tail = node;
+}
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+void TimerManager::Cascade(int level) {
+    const unsigned long next_tick = tick_ + 1;
+    const auto index =
+        (next_tick >> (kWheelBits * level)) & (kWheelSlots - 1);
+    auto& slot = slots_[level * kWheelSlots + index];
+    TimerNode* node = slot.head;
+    slot.head = slot.tail = nullptr;
+    while (node) {
+        TimerNode* next = node->next;
+        Insert(node);
+        node = next;
+    }
 }
 
-bool TimerManager::Tick() {
-    ++tick_;
+std::optional<unsigned long> TimerManager::NextExpiry() {
+    SpinLockGuard guard{lock_};
+    const unsigned long base = tick_ + 1;
+    for (unsigned long t = base; t < base + kWheelSlots; ++t) {
+        if (slots_[t & (kWheelSlots - 1)].head) {
+            return t;
+        }
+    }
+    // timers on the upper levels are not looked into; waking up at the next
+    // cascade is early enough
+    for (int i = kWheelSlots; i < kWheelSlots * kWheelLevels; ++i) {
+        if (slots_[i].head) {
+            return (base + kWheelSlots - 1) & ~(kWheelSlots - 1ul);
+        }
+    }
+    return std::nullopt;
+}
 
-    bool task_timer_timeout = false;
-    while (true) {
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_) {
-            break;
+void TimerManager::Tick() {
+    TimerNode* node;
+    {
+        SpinLockGuard guard{lock_};
+        const unsigned long now = tick_ + 1;
+        for (int level = 1; level < kWheelLevels; ++level) {
+            if (now & ((1ul << (kWheelBits * level)) - 1)) {
+                break;
+            }
+            Cascade(level);
         }
 
-        if (t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-            continue;
+        auto& slot = slots_[now & (kWheelSlots - 1)];
+        node = slot.head;
+        slot.head = slot.tail = nullptr;
+        tick_ = now;
+    }
+
+    Expire(node);
+}
+
+std::optional<uint64_t> TimerManager::NextHRExpiry(int cpu) {
+    auto& queue = hr_queues_[cpu];
+    SpinLockGuard guard{queue.lock};
+    if (queue.head == nullptr) {
+        return std::nullopt;
+    }
+    return queue.head->timer.Timeout();
+}
+
+void TimerManager::ExpireHRTimers(int cpu) {
+    auto& queue = hr_queues_[cpu];
+    TimerNode* expired;
+    {
+        SpinLockGuard guard{queue.lock};
+        const uint64_t now = CurrentTimeNs();
+        TimerNode** next = &queue.head;
+        while (*next && (*next)->timer.Timeout() <= now) {
+            next = &(*next)->next;
         }
+        expired = queue.head;
+        queue.head = *next;
+        *next = nullptr;
+    }
+
+    TimerNode* periodic = Expire(expired);
+    if (periodic == nullptr) {
+        return;
+    }
+    const uint64_t now = CurrentTimeNs();
+    SpinLockGuard guard{queue.lock};
+    while (periodic) {
+        TimerNode* next = periodic->next;
+        auto& t = periodic->timer;
+        // periods missed while interrupts were held off are skipped
+        const auto periods = (now - t.Timeout()) / t.Period() + 1;
+        t = Timer{t.Timeout() + periods * t.Period(), t.Value(), t.TaskID(),
+                  t.Period()};
+        InsertHR(queue, periodic);
+        periodic = next;
+    }
+}
+
+void TimerManager::InsertHR(HRQueue& queue, TimerNode* node) {
+    TimerNode** next = &queue.head;
+    while (*next && (*next)->timer.Timeout() <= node->timer.Timeout()) {
+        next = &(*next)->next;
+    }
+    node->next = *next;
+    *next = node;
+}
+
+TimerNode* TimerManager::Expire(TimerNode* node) {
+    TimerNode* periodic = nullptr;
+    while (node) {
+        TimerNode* next = node->next;
+        const auto& t = node->timer;
 
-         Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(t.TaskID(), m);
+        Error err = MAKE_ERROR(Error::kSuccess);
+        {
+            SpinLockGuard task_guard{task_lock};
+            if (t.Value() == Timer::kWakeup) {
+                err = task_manager->Wakeup(t.TaskID());
+            } else {
+                Message m{Message::kTimerTimeout};
+                m.arg.timer.timeout = t.Timeout();
+                m.arg.timer.value = t.Value();
+                // a periodic timer keeps one timeout queued at most, so a
+                // slow task does not fill its ring with them
+                err = task_manager->PostMessage(t.TaskID(), m, t.Period() > 0);
+            }
+        }
 
-        timers_.pop();
+        if (t.Period() > 0 && err.Cause() != Error::kNoSuchTask) {
+            node->next = periodic;
+            periodic = node;
+        } else {
+            timer_cache.Free(node);
+        }
+        node = next;
     }
-    return task_timer_timeout;
+    return periodic;
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
+  const int cpu = CurrentCPU();
+  auto& t = cpu_timers[cpu];
+  ++t.interrupts;
+  Advance(t, cpu);
+  if (cpu == 0) {
+    while (pending_counts >= counts_per_tick) {
+      pending_counts -= counts_per_tick;
+      timer_manager->Tick();
+    }
+  }
+  timer_manager->ExpireHRTimers(cpu);
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
+  if (!t.idle && t.slice_left <= 0 && task_manager) {
+    t.slice_left = slice_counts;
     task_manager->SwitchTask(ctx_stack);
   }
-}
\ No newline at end of file
+  // not reached if SwitchTask has switched; FinishSwitch programs the timer
+  UpdateLAPICTimer(task_manager && task_manager->Idle());
+}
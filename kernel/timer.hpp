@@ -1,50 +1,135 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <queue>
-#include <vector>
-#include <limits>
+#include <optional>
 #include "../libs/common/message.hpp"
+#include "error.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 void InitializeLAPICTimer();
+/** @brief puts the timer of an application processor into one-shot mode */
+void SetupLAPICTimer();
+/** @brief programs the next timer interrupt of the running CPU
+ *
+ * Called with interrupts disabled whenever the CPU may have gone idle or
+ * busy. An idle CPU gets no interrupt until the next timer expiry (BSP) or
+ * until another CPU wakes it up.
+ */
+void UpdateLAPICTimer(bool idle);
+/** @brief nanoseconds since InitializeLAPICTimer, read from the TSC */
+uint64_t CurrentTimeNs();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
 class Timer {
     public:
-     Timer(unsigned long timeout, int value, uint64_t task_id);
+     /** @brief value of a timer that wakes the task up instead of sending
+      * a message */
+     static const int kWakeup = 0;
+
+     /** @brief a non-zero period re-arms the timer after every timeout; only
+      * high-resolution timers have one */
+     Timer(unsigned long timeout, int value, uint64_t task_id,
+           unsigned long period = 0);
      unsigned long Timeout() const { return timeout_; }
      int Value() const { return value_; }
      uint64_t TaskID() const { return task_id_; }
+     unsigned long Period() const { return period_; }
 
     private:
      unsigned long timeout_;
      int value_;
     uint64_t task_id_;
+     unsigned long period_;
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
+struct TimerNode {
+    TimerNode* next;
+    Timer timer;
+};
 
+/** @brief hierarchical timing wheel
+ *
+ * Level n has kWheelSlots slots covering kWheelSlots^n ticks each. When the
+ * slots of a level wrap around, the next slot of the level above is spread
+ * over the lower levels. Adding and expiring a timer take constant time.
+ */
 class TimerManager {
     public:
-     TimerManager();
-     void AddTimer(const Timer& timer);
-     bool Tick();
+     Error AddTimer(const Timer& timer);
+     /** @brief adds a timer whose timeout is a CurrentTimeNs value
+      *
+      * It is kept apart from the tick timers and expires on the CPU that
+      * added it, as soon as its local APIC timer can be made to fire.
+      */
+     Error AddHRTimer(const Timer& timer);
+     /** @brief removes the pending timers of task_id with value
+      *
+      * Both kinds of timers are removed. Returns how many were removed.
+      * Timeouts already delivered stay in the message queue of the task.
+      */
+     size_t CancelTimer(uint64_t task_id, int value);
+     void Tick();
      unsigned long CurrentTick() const { return tick_; }
+     /** @brief tick by which Tick must have been called again, if any timer
+      * is pending */
+     std::optional<unsigned long> NextExpiry();
+     std::optional<uint64_t> NextHRExpiry(int cpu);
+     /** @brief delivers the high-resolution timers of cpu that are due */
+     void ExpireHRTimers(int cpu);
 
     private:
+     static const int kWheelBits = 6;
+     static const int kWheelSlots = 1 << kWheelBits;
+     static const int kWheelLevels = 4;
+
+     // timers in a slot fire in the order they were added
+     struct Slot {
+         TimerNode* head{nullptr};
+         TimerNode* tail{nullptr};
+     };
+
+     // high-resolution timers sorted by timeout; only a few are pending at
+     // a time, so a list is enough
+     struct HRQueue {
+         TimerNode* head{nullptr};
+         SpinLock lock;
+     };
+
      volatile unsigned long tick_{0};
-     std::priority_queue<Timer> timers_{};
+     std::array<Slot, kWheelSlots * kWheelLevels> slots_{};
+     SpinLock lock_;
+     std::array<HRQueue, kMaxCPUs> hr_queues_{};
+
+     void Insert(TimerNode* node);
+     void Cascade(int level);
+     static void InsertHR(HRQueue& queue, TimerNode* node);
+     /** @brief posts the timeouts of a list of nodes
+      *
+      * One-shot timers are freed. Periodic ones are returned as a list to be
+      * re-armed, unless their task has finished. A periodic timeout still
+      * queued is replaced rather than followed by another one.
+      */
+     static TimerNode* Expire(TimerNode* node);
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
+extern unsigned long tsc_freq;
 const int kTimerFreq = 100;
 
+// ticks of the local APIC timer between task switches on each CPU
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
+
+struct LAPICTimerStat {
+    uint64_t busy_ticks;
+    uint64_t idle_ticks;
+    uint64_t interrupts;
+};
+LAPICTimerStat GetLAPICTimerStat(int cpu);
 
 void LAPICTimerOnInterrupt();
\ No newline at end of file
@@ -139,6 +139,7 @@ struct Message {
             uint32_t count;
             uint32_t offset;
             uint32_t cluster;  // use for directory
+            uint64_t grant;    // 0: data is carried in the messages
         } read;
 
         struct {
@@ -149,6 +150,7 @@ struct Message {
             uint32_t count;
             uint32_t offset;
             uint32_t cluster;
+            uint64_t grant;  // 0: data is carried in the messages
         } write;
 
         struct {
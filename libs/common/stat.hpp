@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+/* kind argument of SyscallGetStat */
+enum StatKind {
+    kStatIPC,
+    kStatSyscall,
+    kStatCPU,
+    kStatPageFault,
+    kStatSlab,
+};
+
+/* number of syscall slots counted by kStatSyscall */
+enum { kSyscallStatCount = 64 };
+
+/* number of CPU entries in CPUStat */
+enum { kCPUStatCount = 16 };
+
+/* number of cache entries in SlabStats */
+enum { kSlabStatCount = 16 };
+
+struct IPCStat {
+    uint64_t sent;       /* messages queued by SendMessage and its variants */
+    uint64_t handoffs;   /* sends that switched straight to the receiver */
+    uint64_t deferred;   /* messages a closed receive left queued; each one
+                            used to be bounced back as a retry */
+    /* interrupt ring counters, summed over live tasks */
+    uint64_t irq_dropped;
+    uint64_t irq_coalesced;
+};
+
+struct SyscallStat {
+    uint64_t calls[kSyscallStatCount]; /* indexed by syscall number */
+};
+
+struct CPUStatEntry {
+    uint64_t busy_ticks;     /* timer ticks spent running a task */
+    uint64_t idle_ticks;     /* timer ticks spent in the idle task */
+    uint64_t queued;         /* runnable tasks waiting behind the running one */
+    uint64_t steals;         /* tasks taken from other CPUs while idle */
+    uint64_t stolen;         /* tasks other CPUs took from this one */
+    uint64_t affine_wakeups; /* receivers pulled over to their sender */
+    uint64_t timer_interrupts; /* an idle CPU takes hardly any */
+    uint64_t switches;      /* switches through SwitchContext (IPC, sleep) */
+    uint64_t switch_cycles; /* TSC cycles they took, FPU save and restore
+                               included */
+};
+
+struct PageFaultStat {
+    uint64_t faults;          /* page faults taken, including fatal ones */
+    uint64_t fault_ns;        /* time spent resolving them */
+    uint64_t demand_pages;    /* demand paging pages mapped by faults */
+    uint64_t around_pages;    /* of those, neighbours of the faulting page */
+    uint64_t zero_maps;       /* read faults served by the zero page */
+    uint64_t file_pages;      /* executable pages mapped from the cache */
+    uint64_t copies;          /* copy-on-write faults */
+    uint64_t populated_pages; /* mapped up front by DEMAND_PAGES_POPULATE */
+    uint64_t large_pages;     /* 2 MiB pages mapped */
+    uint64_t large_splits;    /* 2 MiB pages split into 4 KiB pages */
+};
+
+struct CPUStat {
+    uint64_t cpus; /* online CPUs; the entries after them are zero */
+    struct CPUStatEntry cpu[kCPUStatCount];
+};
+
+struct SlabCacheStat {
+    char name[24];
+    uint64_t object_size;
+    uint64_t objects_per_slab;
+    uint64_t slabs;
+    uint64_t active_objects;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+struct SlabStats {
+    uint64_t caches; /* caches that have created a slab, at most
+                        kSlabStatCount of them reported */
+    struct SlabCacheStat cache[kSlabStatCount];
+};
@@ -14,10 +14,9 @@ int OpenWindow(int w, int h, int x, int y, char* title) {
         msg.arg.openwindow.y = y;
         strncpy(msg.arg.openwindow.title, title,
                 16 - 1);  // to allocate the null terminator
-        SyscallSendMessage(&msg, id);
         Message rmsg[1];
         int layer_id;
-        auto [n, err2] = SyscallClosedReceiveMessage(rmsg, 1, id);
+        auto [n, err2] = SyscallCall(&msg, id, rmsg);
         if (err2) {
             layer_id = -1;
             return layer_id;
@@ -64,11 +63,31 @@ void WinWriteChar(int layer_id, bool draw, int x, int y, uint32_t color,
 
 void WinWriteString(int layer_id, bool draw, int x, int y, uint32_t color,
                     char* s) {
-    int x_c = 0;
-    while (*s) {
-        WinWriteChar(layer_id, draw, x + x_c, y, color, *s);
-        ++s;
-        x_c = x_c + 8;
+    WinWriteChars(layer_id, draw, x, y, color, s, strlen(s));
+}
+
+void WinWriteChars(int layer_id, bool draw, int x, int y, uint32_t color,
+                   const char* s, size_t len) {
+    auto [id, err] = SyscallFindServer("servers/gui");
+    if (err) {
+        return;
+    }
+
+    Message msgs[32];
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        auto& msg = msgs[n++];
+        msg.type = Message::kWinWriteChar;
+        msg.arg.winwritechar.layer_id = layer_id;
+        msg.arg.winwritechar.draw = draw;
+        msg.arg.winwritechar.x = x + 8 * i;
+        msg.arg.winwritechar.y = y;
+        msg.arg.winwritechar.color = color;
+        msg.arg.winwritechar.c = s[i];
+        if (n == 32 || i == len - 1) {
+            SyscallSendMessages(msgs, n, id);
+            n = 0;
+        }
     }
 }
 
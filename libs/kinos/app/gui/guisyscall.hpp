@@ -16,6 +16,9 @@ void WinWriteChar(int layer_id, bool draw, int x, int y, uint32_t color,
                   char c);
 void WinWriteString(int layer_id, bool draw, int x, int y, uint32_t color,
                     char* s);
+/** @brief writes len characters left to right with batched sends */
+void WinWriteChars(int layer_id, bool draw, int x, int y, uint32_t color,
+                   const char* s, size_t len);
 void WinDrawLine(int layer_id, bool draw, int x0, int y0, int x1, int y1,
                  uint32_t color);
 void WinMoveRec(int layer_id, bool draw, int x0, int y0, int rx0, int ry0,
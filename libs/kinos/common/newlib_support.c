@@ -66,6 +66,19 @@ caddr_t sbrk(int incr) {
 
     const uint64_t prev_break = program_break;
     program_break += incr;
+
+    /* return whole pages malloc has trimmed, as long as nobody else has
+     * taken demand paging pages after ours */
+    const uint64_t break_page = (program_break + 4095) & ~4095ul;
+    if (incr < 0 && dpage_end > break_page &&
+        SyscallDemandPages(0, 0).value == dpage_end) {
+        size_t num_pages = (dpage_end - break_page) / 4096;
+        struct SyscallResult res =
+            SyscallDemandPages(num_pages, DEMAND_PAGES_RELEASE);
+        if (!res.error) {
+            dpage_end = res.value;
+        }
+    }
     return (caddr_t)prev_break;
 }
 
@@ -97,13 +110,12 @@ int open(const char* path, int flags) {
         smsg.arg.open.filename[i] = '\0';
         smsg.arg.open.flags = flags;
 
-        SyscallSendMessage(&smsg, id.value);
+        SyscallCall(&smsg, id.value, &rmsg);
 
         while (1) {
-            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
             if (rmsg.type == kError) {
                 if (rmsg.arg.error.retry) {
-                    SyscallSendMessage(&smsg, id.value);
+                    SyscallCall(&smsg, id.value, &rmsg);
                     continue;
                 } else {
                     errno = rmsg.arg.error.err;
@@ -112,6 +124,7 @@ int open(const char* path, int flags) {
             } else if (rmsg.type == kOpen) {
                 break;
             }
+            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
         }
         return rmsg.arg.open.fd;
     }
@@ -126,25 +139,36 @@ ssize_t read(int fd, void* buf, size_t count) {
         struct Message smsg;
         struct Message rmsg;
 
+        // lend buf to am so that the data can be copied in at once;
+        // without a grant it comes back in small messages
+        struct SyscallResult grant =
+            SyscallGrant(buf, count, id.value, GRANT_WRITE);
+
         smsg.type = kRead;
         smsg.arg.read.fd = fd;
         smsg.arg.read.count = count;
-        SyscallSendMessage(&smsg, id.value);
+        smsg.arg.read.grant = grant.error ? 0 : grant.value;
+        SyscallCall(&smsg, id.value, &rmsg);
 
         const char* bufc = (const char*)buf;
         size_t read_bytes = 0;
         while (1) {
-            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
             if (rmsg.type == kError) {
                 if (rmsg.arg.error.retry) {
-                    SyscallSendMessage(&smsg, id.value);
+                    SyscallCall(&smsg, id.value, &rmsg);
                     continue;
                 } else {
+                    if (smsg.arg.read.grant) {
+                        SyscallRevokeGrant(smsg.arg.read.grant);
+                    }
                     errno = EAGAIN;
                     return -1;
                 }
             } else if (rmsg.type == kRead) {
-                if (rmsg.arg.read.len) {
+                if (rmsg.arg.read.grant) {
+                    read_bytes = rmsg.arg.read.count;
+                    break;
+                } else if (rmsg.arg.read.len) {
                     memcpy(&bufc[read_bytes], rmsg.arg.read.data,
                            rmsg.arg.read.len);
                     read_bytes += rmsg.arg.read.len;
@@ -152,6 +176,10 @@ ssize_t read(int fd, void* buf, size_t count) {
                     break;
                 }
             }
+            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
+        }
+        if (smsg.arg.read.grant) {
+            SyscallRevokeGrant(smsg.arg.read.grant);
         }
         return read_bytes;
     }
@@ -168,9 +196,49 @@ ssize_t write(int fd, const void* buf, size_t count) {
 
         smsg.type = kWrite;
         smsg.arg.write.fd = fd;
-        smsg.arg.write.count = count;
         const char* bufc = (const char*)buf;
         size_t sent_bytes = 0;
+
+        // lend the rest of buf to am for each request; a pipe may take only
+        // a part of it
+        while (sent_bytes < count) {
+            struct SyscallResult grant = SyscallGrant(
+                &bufc[sent_bytes], count - sent_bytes, id.value, GRANT_READ);
+            if (grant.error) {
+                break;
+            }
+            smsg.arg.write.count = count - sent_bytes;
+            smsg.arg.write.len = 0;
+            smsg.arg.write.grant = grant.value;
+            SyscallCall(&smsg, id.value, &rmsg);
+
+            while (1) {
+                if (rmsg.type == kError) {
+                    if (rmsg.arg.error.retry) {
+                        SyscallCall(&smsg, id.value, &rmsg);
+                        continue;
+                    } else {
+                        SyscallRevokeGrant(grant.value);
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                } else if (rmsg.type == kReceived) {
+                    break;
+                }
+                SyscallClosedReceiveMessage(&rmsg, 1, id.value);
+            }
+            SyscallRevokeGrant(grant.value);
+            if (rmsg.arg.write.count == 0) {
+                break;
+            }
+            sent_bytes += rmsg.arg.write.count;
+        }
+        if (count && sent_bytes == count) {
+            return sent_bytes;
+        }
+
+        smsg.arg.write.count = count;
+        smsg.arg.write.grant = 0;
         while (sent_bytes < count) {
             if (count - sent_bytes > sizeof(smsg.arg.write.data)) {
                 smsg.arg.write.len = sizeof(smsg.arg.write.data);
@@ -179,13 +247,12 @@ ssize_t write(int fd, const void* buf, size_t count) {
             }
             memcpy(smsg.arg.write.data, &bufc[sent_bytes], smsg.arg.write.len);
             sent_bytes += smsg.arg.write.len;
-            SyscallSendMessage(&smsg, id.value);
+            SyscallCall(&smsg, id.value, &rmsg);
 
             while (1) {
-                SyscallClosedReceiveMessage(&rmsg, 1, id.value);
                 if (rmsg.type == kError) {
                     if (rmsg.arg.error.retry) {
-                        SyscallSendMessage(&smsg, id.value);
+                        SyscallCall(&smsg, id.value, &rmsg);
                         continue;
                     } else {
                         errno = EAGAIN;
@@ -194,16 +261,16 @@ ssize_t write(int fd, const void* buf, size_t count) {
                 } else if (rmsg.type == kReceived) {
                     break;
                 }
+                SyscallClosedReceiveMessage(&rmsg, 1, id.value);
             }
         }
         smsg.type = kWrite;
         smsg.arg.write.len = 0;
-        SyscallSendMessage(&smsg, id.value);
+        SyscallCall(&smsg, id.value, &rmsg);
         while (1) {
-            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
             if (rmsg.type == kError) {
                 if (rmsg.arg.error.retry) {
-                    SyscallSendMessage(&smsg, id.value);
+                    SyscallCall(&smsg, id.value, &rmsg);
                     continue;
                 } else {
                     errno = EAGAIN;
@@ -212,6 +279,7 @@ ssize_t write(int fd, const void* buf, size_t count) {
             } else if (rmsg.type == kReceived) {
                 break;
             }
+            SyscallClosedReceiveMessage(&rmsg, 1, id.value);
         }
         return sent_bytes;
     }
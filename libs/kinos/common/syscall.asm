@@ -30,6 +30,23 @@ define_syscall ReadVolumeImage,     0x80000010
 define_syscall CopyToVolumeImage,   0x80000011
 define_syscall ReadKernelLog,       0x80000012
 define_syscall WriteKernelLog,      0x80000013
+define_syscall Call,                0x80000014
+define_syscall ReplyWait,           0x80000015
+define_syscall GetStat,             0x80000016
+define_syscall Grant,               0x80000017
+define_syscall RevokeGrant,         0x80000018
+define_syscall PassGrant,           0x80000019
+define_syscall CopyFromGrant,       0x8000001a
+define_syscall CopyToGrant,         0x8000001b
+define_syscall CreateSharedRegion,  0x8000001c
+define_syscall MapSharedRegion,     0x8000001d
+define_syscall UnmapSharedRegion,   0x8000001e
+define_syscall SendMessages,        0x8000001f
+define_syscall CancelTimer,         0x80000020
+define_syscall GetTimeNs,           0x80000021
+define_syscall CreateTimerNs,       0x80000022
+define_syscall Sleep,               0x80000023
+define_syscall AllowSharedRegion,   0x80000024
 
 
 
@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 #include "../../common/message.hpp"
+#include "../../common/stat.hpp"
 
 struct SyscallResult {
     uint64_t value;
@@ -21,7 +22,24 @@ struct SyscallResult SyscallGetCurrentTick();
 #define TIMER_ONESHOT_ABS 0
 struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value,
                                         unsigned long timeout_ms);
+/* nanoseconds since boot */
+struct SyscallResult SyscallGetTimeNs();
+/* TIMER_PERIODIC: timeout_ns is the period; the first timeout comes one
+ * period from now */
+#define TIMER_PERIODIC 2
+/* CreateTimer with a timeout in nanoseconds, as returned by SyscallGetTimeNs;
+ * returns the absolute (first) timeout in nanoseconds */
+struct SyscallResult SyscallCreateTimerNs(unsigned int type, int timer_value,
+                                          unsigned long timeout_ns);
+/* blocks the calling task for at least ns nanoseconds */
+struct SyscallResult SyscallSleep(unsigned long ns);
+/* cancels the pending timers created with timer_value; returns how many */
+struct SyscallResult SyscallCancelTimer(int timer_value);
 
+/* DEMAND_PAGES_POPULATE: map the pages now instead of on first touch
+ * DEMAND_PAGES_RELEASE: give the last num_pages back; returns the new end */
+#define DEMAND_PAGES_POPULATE 1
+#define DEMAND_PAGES_RELEASE 2
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 /*--------------------------------------------------------------------------
  * system calls for task
@@ -44,6 +62,38 @@ struct SyscallResult SyscallClosedReceiveMessage(struct Message *msg,
                                                  size_t len,
                                                  uint64_t target_id);
 struct SyscallResult SyscallSendMessage(struct Message *msg, uint64_t id);
+/* sends n messages to dest with one kernel entry; returns how many were
+ * queued */
+struct SyscallResult SyscallSendMessages(const struct Message *msgs, size_t n,
+                                         uint64_t dest);
+/* sends msg to dest and waits for one message from dest */
+struct SyscallResult SyscallCall(struct Message *msg, uint64_t dest,
+                                 struct Message *reply);
+/* sends msg to reply_to (unless it is 0) and waits for the next message */
+struct SyscallResult SyscallReplyWait(uint64_t reply_to, struct Message *msg,
+                                      struct Message *out);
+
+/* lends [addr, addr + len) to grantee until the grant is revoked */
+#define GRANT_READ 1
+#define GRANT_WRITE 2
+struct SyscallResult SyscallGrant(const void *addr, size_t len,
+                                  uint64_t grantee, int flags);
+struct SyscallResult SyscallRevokeGrant(uint64_t grant);
+/* called by the grantee to forward a grant to new_grantee */
+struct SyscallResult SyscallPassGrant(uint64_t grant, uint64_t new_grantee);
+struct SyscallResult SyscallCopyFromGrant(uint64_t grant, size_t offset,
+                                          void *buf, size_t len);
+struct SyscallResult SyscallCopyToGrant(uint64_t grant, size_t offset,
+                                        const void *buf, size_t len);
+
+/* a region lives while its creator runs or any task has it mapped */
+struct SyscallResult SyscallCreateSharedRegion(size_t bytes);
+/* called by the creator to let task map the region */
+struct SyscallResult SyscallAllowSharedRegion(uint64_t region, uint64_t task);
+/* returns the address the region is mapped at; only the creator and the
+ * tasks it allowed may map it */
+struct SyscallResult SyscallMapSharedRegion(uint64_t region);
+struct SyscallResult SyscallUnmapSharedRegion(void *addr);
 
 /*--------------------------------------------------------------------------
  * system calls for GUI server
@@ -75,6 +125,8 @@ struct SyscallResult SyscallCopyToVolumeImage(void *buf,
 struct SyscallResult SyscallFindServer(const char *name);
 struct SyscallResult SyscallReadKernelLog(char *buf, size_t len);
 struct SyscallResult SyscallWriteKernelLog(char *buf);
+/* copies the kernel counters selected by kind (enum StatKind) into buf */
+struct SyscallResult SyscallGetStat(int kind, void *buf, size_t len);
 
 #ifdef __cplusplus
 }  // extern "C"
@@ -40,6 +40,7 @@ class ApplicationManagementServer {
 
     uint64_t target_id_;
     uint64_t new_id_;
+    uint64_t reply_to_ = 0;
 
     char command_[32];
     char argument_[32];
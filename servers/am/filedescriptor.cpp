@@ -1,5 +1,6 @@
 #include "filedescriptor.hpp"
 
+#include <algorithm>
 #include <cstring>
 
 #include "../../libs/kinos/common/print.hpp"
@@ -11,14 +12,36 @@ TerminalFileDescriptor::TerminalFileDescriptor(uint64_t id) : id_{id} {
 }
 
 size_t TerminalFileDescriptor::Write(Message msg) {
-    SyscallSendMessage(&msg, terminal_server_id_);
-
     Message smsg;
     smsg.type = Message::kReceived;
+
+    if (msg.arg.write.grant) {
+        // the terminal still takes the text in small pieces, but the
+        // application is done after a single request
+        const uint64_t grant = msg.arg.write.grant;
+        const size_t count = msg.arg.write.count;
+        msg.arg.write.grant = 0;
+        size_t sent_bytes = 0;
+        while (sent_bytes < count) {
+            size_t n = std::min(sizeof(msg.arg.write.data), count - sent_bytes);
+            if (SyscallCopyFromGrant(grant, sent_bytes, msg.arg.write.data, n)
+                    .error) {
+                break;
+            }
+            msg.arg.write.len = n;
+            SyscallSendMessage(&msg, terminal_server_id_);
+            sent_bytes += n;
+        }
+        smsg.arg.write.count = sent_bytes;
+    } else {
+        SyscallSendMessage(&msg, terminal_server_id_);
+    }
+
     SyscallSendMessage(&smsg, id_);
     return 0;
 }
 size_t TerminalFileDescriptor::Read(Message msg) {
+    const uint64_t grant = msg.arg.read.grant;
     SyscallSendMessage(&msg, terminal_server_id_);
     Message rmsg;
     Message smsg;
@@ -26,9 +49,19 @@ size_t TerminalFileDescriptor::Read(Message msg) {
     SyscallClosedReceiveMessage(&rmsg, 1, terminal_server_id_);
     switch (rmsg.type) {
         case Message::kRead:
+            if (grant && !SyscallCopyToGrant(grant, 0, rmsg.arg.read.data,
+                                             rmsg.arg.read.len)
+                              .error) {
+                rmsg.arg.read.count = rmsg.arg.read.len;
+                rmsg.arg.read.grant = grant;
+                SyscallSendMessage(&rmsg, id_);
+                break;
+            }
+            rmsg.arg.read.grant = 0;
             SyscallSendMessage(&rmsg, id_);
             smsg.type = Message::kRead;
             smsg.arg.read.len = 0;
+            smsg.arg.read.grant = 0;
             SyscallSendMessage(&smsg, id_);
             break;
 
@@ -59,11 +92,20 @@ size_t FatFileDescriptor::Read(Message msg) {
         SyscallSendMessage(&msg, id_);
         return 0;
     } else {
+        // fs copies the data into the buffer of the application
+        if (msg.arg.read.grant &&
+            SyscallPassGrant(msg.arg.read.grant, fs_id).error) {
+            msg.arg.read.grant = 0;
+        }
         SyscallSendMessage(&msg, fs_id);
         Message rmsg;
         while (1) {
             SyscallClosedReceiveMessage(&rmsg, 1, fs_id);
-            if (rmsg.arg.read.len != 0) {
+            if (rmsg.arg.read.grant) {
+                SyscallSendMessage(&rmsg, id_);
+                rd_off_ += rmsg.arg.read.count;
+                break;
+            } else if (rmsg.arg.read.len != 0) {
                 SyscallSendMessage(&rmsg, id_);
                 rd_off_ += rmsg.arg.read.len;
                 rd_cluster_ = rmsg.arg.read.cluster;
@@ -85,6 +127,24 @@ size_t FatFileDescriptor::Write(Message msg) {
         Print("[ am ] cannnot find file system server\n");
         SyscallSendMessage(&msg, id_);
         return 0;
+    } else if (msg.arg.write.grant) {
+        Message rmsg;
+        if (SyscallPassGrant(msg.arg.write.grant, fs_id).error) {
+            rmsg.type = Message::kError;
+            rmsg.arg.error.retry = false;
+            rmsg.arg.error.err = EFAULT;
+            SyscallSendMessage(&rmsg, id_);
+            return 0;
+        }
+
+        // fs copies the data out of the buffer of the application and
+        // answers when it is done with it
+        strcpy(msg.arg.write.filename, filename_);
+        msg.arg.write.offset = wr_off_;
+        SyscallCall(&msg, fs_id, &rmsg);
+        wr_off_ += rmsg.arg.write.count;
+        SyscallSendMessage(&rmsg, id_);
+        return rmsg.arg.write.count;
     } else {
         strcpy(msg.arg.write.filename, filename_);
         msg.arg.write.offset = wr_off_;
@@ -122,10 +182,12 @@ size_t PipeFileDescriptor::Read(Message msg) {
         Message smsg;
         smsg.type = Message::kRead;
         smsg.arg.read.len = 0;
+        smsg.arg.read.grant = 0;
         SyscallSendMessage(&smsg, msg.src_task);
         return 0;
     } else {
-        size_t count = msg.arg.read.count;
+        size_t count = std::min<size_t>(msg.arg.read.count, len_);
+        const uint64_t grant = msg.arg.read.grant;
         Message smsg;
 
         if (len_ == 0) {
@@ -133,34 +195,36 @@ size_t PipeFileDescriptor::Read(Message msg) {
             smsg.arg.error.retry = true;
             SyscallSendMessage(&smsg, msg.src_task);
             return 0;
+        }
 
-        } else if (len_ <= count) {
-            smsg.type = Message::kRead;
-            memcpy(smsg.arg.read.data, data_, len_);
-            smsg.arg.read.len = len_;
-            len_ = 0;
-            memset(data_, 0, sizeof(data_));
+        smsg.type = Message::kRead;
+        if (grant && !SyscallCopyToGrant(grant, 0, data_, count).error) {
+            smsg.arg.read.len = 0;
+            smsg.arg.read.count = count;
+            smsg.arg.read.grant = grant;
             SyscallSendMessage(&smsg, msg.src_task);
-
-            smsg.type = Message::kRead;
+        } else {
+            smsg.arg.read.grant = 0;
+            for (size_t off = 0; off < count;
+                 off += sizeof(smsg.arg.read.data)) {
+                smsg.arg.read.len =
+                    std::min(sizeof(smsg.arg.read.data), count - off);
+                memcpy(smsg.arg.read.data, &data_[off], smsg.arg.read.len);
+                SyscallSendMessage(&smsg, msg.src_task);
+            }
             smsg.arg.read.len = 0;
             SyscallSendMessage(&smsg, msg.src_task);
+        }
 
+        len_ -= count;
+        memmove(data_, &data_[count], len_);
+        if (len_ == 0) {
+            // the writer waits until everything it wrote has been read
             smsg.type = Message::kReceived;
+            smsg.arg.write.count = accepted_;
             SyscallSendMessage(&smsg, id_);
-            return 0;
-        } else if (len_ > count) {
-            smsg.type = Message::kRead;
-            memcpy(smsg.arg.read.data, data_, count);
-            smsg.arg.read.len = count;
-            len_ -= count;
-            SyscallSendMessage(&smsg, msg.src_task);
-            smsg.arg.read.len = 0;
-            SyscallSendMessage(&smsg, msg.src_task);
-
-            memmove(data_, &data_[count], len_);
-            return 0;
         }
+        return count;
     }
 }
 
@@ -173,12 +237,20 @@ size_t PipeFileDescriptor::Write(Message msg) {
         return 0;
     } else {
         if (len_ == 0) {
-            if (msg.arg.write.len) {
-                len_ = msg.arg.write.len;
-                memcpy(data_, msg.arg.write.data, len_);
+            if (msg.arg.write.grant) {
+                size_t n = std::min<size_t>(msg.arg.write.count, kBufferSize);
+                auto [copied, err] =
+                    SyscallCopyFromGrant(msg.arg.write.grant, 0, data_, n);
+                len_ = accepted_ = copied;
             } else {
+                len_ = accepted_ = msg.arg.write.len;
+                memcpy(data_, msg.arg.write.data, len_);
+            }
+
+            if (len_ == 0) {
                 Message smsg;
                 smsg.type = Message::kReceived;
+                smsg.arg.write.count = 0;
                 SyscallSendMessage(&smsg, id_);
             }
         } else {
@@ -58,9 +58,11 @@ class PipeFileDescriptor : public FileDescriptor {
     void Close() override;
 
    private:
+    static const size_t kBufferSize = 4096;
+
     uint64_t id_;
-    char data_[16];
+    char data_[kBufferSize];
     size_t len_{0};
-    size_t count_;
+    size_t accepted_{0};  // bytes of the last write, acked once drained
     bool closed_{false};
 };
\ No newline at end of file
@@ -13,7 +13,9 @@ ServerState* ErrState::SendMessage() {
 };
 
 ServerState* InitState::ReceiveMessage() {
-    SyscallOpenReceiveMessage(&server_->rm_, 1);
+    // the reply left by SendMessage goes out in the same syscall
+    SyscallReplyWait(server_->reply_to_, &server_->sm_, &server_->rm_);
+    server_->reply_to_ = 0;
 
     auto [fs_id, err] = SyscallFindServer("servers/fs");
     if (err) {
@@ -58,7 +60,7 @@ ServerState* InitState::ReceiveMessage() {
 }
 
 ServerState* InitState::SendMessage() {
-    SyscallSendMessage(&server_->sm_, server_->target_id_);
+    server_->reply_to_ = server_->target_id_;
     return this;
 }
 
@@ -89,6 +89,7 @@ class FileSystemServer {
 
     Message sm_;
     Message rm_;
+    bool reply_pending_ = false;
 
     BPB bpb_;
     uint32_t *fat_;  // 1 block = 512 bytes
@@ -16,13 +16,20 @@ ServerState *ErrState::SendMessage() {
 }
 
 ServerState *InitState::ReceiveMessage() {
-    while (1) {
+    // the reply left by SendMessage goes out in the same syscall
+    if (server_->reply_pending_) {
+        server_->reply_pending_ = false;
+        SyscallCall(&server_->sm_, server_->am_id_, &server_->rm_);
+    } else {
         SyscallClosedReceiveMessage(&server_->rm_, 1, server_->am_id_);
+    }
+
+    while (1) {
         switch (server_->rm_.type) {
             case Message::kError: {
                 if (server_->rm_.arg.error.retry) {
-                    SyscallSendMessage(&server_->sm_, server_->am_id_);
-                    break;
+                    SyscallCall(&server_->sm_, server_->am_id_, &server_->rm_);
+                    continue;
                 } else {
                     Print("[ fs ] error at am server\n");
                     return server_->GetServerState(State::StateErr);
@@ -50,11 +57,12 @@ ServerState *InitState::ReceiveMessage() {
                 Print("[ fs ] unknown message from am server");
                 break;
         }
+        SyscallClosedReceiveMessage(&server_->rm_, 1, server_->am_id_);
     }
 }
 
 ServerState *InitState::SendMessage() {
-    SyscallSendMessage(&server_->sm_, server_->am_id_);
+    server_->reply_pending_ = true;
     return this;
 }
 
@@ -292,6 +300,7 @@ ServerState *OpenState::HandleMessage() {
 
 ServerState *ReadState::HandleMessage() {
     const char *path = server_->rm_.arg.read.filename;
+    server_->sm_.arg.read.grant = 0;
     // root directory
     if (strcmp(path, "/") == 0) {
         auto cluster = server_->bpb_.root_cluster;
@@ -393,6 +402,50 @@ ServerState *ReadState::HandleMessage() {
             }
             goto finish;
 
+        } else if (server_->rm_.arg.read.grant) {
+            // copy whole clusters straight into the buffer of the reader
+            server_->target_entry_ = file_entry;
+            const uint64_t grant = server_->rm_.arg.read.grant;
+            const size_t offset = server_->rm_.arg.read.offset;
+            const size_t file_size = file_entry->file_size;
+            const auto bytes_per_cluster = server_->bytes_per_cluster_;
+
+            size_t count = 0;
+            if (offset < file_size) {
+                count = std::min<size_t>(server_->rm_.arg.read.count,
+                                         file_size - offset);
+            }
+
+            auto cluster = file_entry->FirstCluster();
+            for (size_t i = 0; i < offset / bytes_per_cluster &&
+                               cluster != 0 && cluster != 0x0ffffffflu;
+                 ++i) {
+                cluster = server_->NextCluster(cluster);
+            }
+
+            size_t cluster_off = offset % bytes_per_cluster;
+            size_t sent_bytes = 0;
+            while (cluster != 0 && cluster != 0x0ffffffflu &&
+                   sent_bytes < count) {
+                auto p =
+                    reinterpret_cast<uint8_t *>(server_->ReadCluster(cluster));
+                size_t n = std::min(bytes_per_cluster - cluster_off,
+                                    count - sent_bytes);
+                if (SyscallCopyToGrant(grant, sent_bytes, &p[cluster_off], n)
+                        .error) {
+                    break;
+                }
+                sent_bytes += n;
+                cluster_off = 0;
+                cluster = server_->NextCluster(cluster);
+            }
+
+            server_->sm_.type = Message::kRead;
+            server_->sm_.arg.read.len = 0;
+            server_->sm_.arg.read.count = sent_bytes;
+            server_->sm_.arg.read.grant = grant;
+            return server_->GetServerState(State::StateInit);
+
         } else {
             server_->target_entry_ = file_entry;
 
@@ -466,6 +519,60 @@ ServerState *WriteState::HandleMessage() {
         server_->target_entry_->first_cluster_high = (cluster >> 16) & 0xffff;
         server_->UpdateCluster();
     }
+    if (server_->rm_.arg.write.grant) {
+        // copy whole clusters straight from the buffer of the writer
+        const uint64_t grant = server_->rm_.arg.write.grant;
+        const size_t count = server_->rm_.arg.write.count;
+        const size_t offset = server_->rm_.arg.write.offset;
+        const auto bytes_per_cluster = server_->bytes_per_cluster_;
+        auto buf = reinterpret_cast<uint8_t *>(server_->cluster_buf_);
+
+        for (size_t i = 0; i < offset / bytes_per_cluster; ++i) {
+            auto next_cluster = server_->NextCluster(cluster);
+            if (next_cluster == 0x0ffffffflu) {
+                cluster = server_->ExtendCluster(cluster, 1);
+            } else {
+                cluster = next_cluster;
+            }
+        }
+
+        size_t write_off = offset % bytes_per_cluster;
+        size_t written = 0;
+        while (written < count) {
+            if (write_off == bytes_per_cluster) {
+                auto next_cluster = server_->NextCluster(cluster);
+                if (next_cluster == 0x0ffffffflu) {
+                    cluster = server_->ExtendCluster(cluster, 1);
+                } else {
+                    cluster = next_cluster;
+                }
+                write_off = 0;
+            }
+
+            size_t n = std::min(count - written, bytes_per_cluster - write_off);
+            if (n < bytes_per_cluster) {
+                server_->ReadCluster(cluster);
+            }
+            if (SyscallCopyFromGrant(grant, written, &buf[write_off], n)
+                    .error) {
+                break;
+            }
+            server_->UpdateCluster(cluster);
+            written += n;
+            write_off += n;
+        }
+
+        // the directory entry was in cluster_buf_, look it up again
+        auto [entry, post_slash] = server_->FindFile(path);
+        entry->file_size = offset + written;
+        server_->UpdateCluster();
+
+        server_->sm_.type = Message::kReceived;
+        server_->sm_.arg.write.count = written;
+        server_->sm_.arg.write.grant = grant;
+        return server_->GetServerState(State::StateInit);
+    }
+
     size_t len = server_->rm_.arg.write.len;
 
     // finish writing
@@ -58,8 +58,11 @@ extern "C" int main() {
     layer_task_map = new std::map<unsigned int, uint64_t>;
 
     Message msg[1];
+    Message reply;
+    uint64_t reply_to = 0;
     while (true) {
-        auto [n, err] = SyscallOpenReceiveMessage(msg, 1);
+        auto [n, err] = SyscallReplyWait(reply_to, &reply, msg);
+        reply_to = 0;
         if (err) {
             printk("Receive message failed: %s\n", strerror(err));
         }
@@ -119,9 +122,10 @@ extern "C" int main() {
             active_layer->Activate(layer_id);
             window_layer_id.push_back(layer_id);
 
-            Message rmsg{Message::kLayerId};
-            rmsg.arg.layerid.layerid = layer_id;
-            SyscallSendMessage(&rmsg, task_id);
+            // sent together with the next receive
+            reply.type = Message::kLayerId;
+            reply.arg.layerid.layerid = layer_id;
+            reply_to = task_id;
 
             layer_task_map->insert(std::make_pair(layer_id, task_id));
 
@@ -44,29 +44,35 @@ void SendMouseMessage(Vector2D<int> newpos, Vector2D<int> posdiff,
         return;
     }
     const auto relpos = newpos - layer->GetPosition();
+    Message msgs[9];
+    size_t n = 0;
     if (posdiff.x != 0 || posdiff.y != 0) {
-        Message msg{Message::kMouseMove};
+        Message& msg = msgs[n++];
+        msg.type = Message::kMouseMove;
         msg.arg.mouse_move.x = relpos.x;
         msg.arg.mouse_move.y = relpos.y;
         msg.arg.mouse_move.dx = posdiff.x;
         msg.arg.mouse_move.dy = posdiff.y;
         msg.arg.mouse_move.buttons = buttons;
-        SyscallSendMessage(&msg, task_id);
     }
 
     if (previous_buttons != buttons) {
         const auto diff = previous_buttons ^ buttons;
         for (int i = 0; i < 8; ++i) {
             if ((diff >> i) & 1) {
-                Message msg{Message::kMouseButton};
+                Message& msg = msgs[n++];
+                msg.type = Message::kMouseButton;
                 msg.arg.mouse_button.x = relpos.x;
                 msg.arg.mouse_button.y = relpos.y;
                 msg.arg.mouse_button.press = (buttons >> i) & 1;
                 msg.arg.mouse_button.button = i;
-                SyscallSendMessage(&msg, task_id);
             }
         }
     }
+
+    if (n > 0) {
+        SyscallSendMessages(msgs, n, task_id);
+    }
 }
 void SendCloseMessage() {
     const auto [layer, task_id] = FindActiveLayerTask();
@@ -37,20 +37,36 @@ void Print(uint64_t layer_id, char c) {
     }
 }
 
-void Print(uint64_t layer_id, const char *s, std::optional<size_t> len) {
-    if (len) {
-        for (size_t i = 0; i < *len; ++i) {
-            Print(layer_id, *s);
-            ++s;
+void PrintChars(uint64_t layer_id, const char *s, size_t len, uint32_t color) {
+    size_t i = 0;
+    while (i < len) {
+        if (s[i] == '\n') {
+            Print(layer_id, s[i]);
+            ++i;
+            continue;
         }
-    } else {
-        while (*s) {
-            Print(layer_id, *s);
-            ++s;
+
+        // the rest of the current line goes to the gui server in one batch
+        size_t n = 0;
+        while (i + n < len && s[i + n] != '\n' && cursorx + n < kColumns) {
+            ++n;
+        }
+        WinWriteChars(layer_id, true, CalcCursorPos().x, CalcCursorPos().y,
+                      color, &s[i], n);
+        i += n;
+        cursorx += n - 1;
+        if (cursorx == kColumns - 1) {
+            Print(layer_id, '\n');
+        } else {
+            ++cursorx;
         }
     }
 }
 
+void Print(uint64_t layer_id, const char *s, std::optional<size_t> len) {
+    PrintChars(layer_id, s, len ? *len : strlen(s), 0xffffff);
+}
+
 int PrintToTerminal(uint64_t layer_id, const char *format, ...) {
     va_list ap;
     int result;
@@ -45,6 +45,7 @@ void Scroll1(uint64_t layer_id);
 void Print(uint64_t layer_id, const char* s,
            std::optional<size_t> len = std::nullopt);
 void Print(uint64_t layer_id, char s);
+void PrintChars(uint64_t layer_id, const char* s, size_t len, uint32_t color);
 void PrintInGreen(uint64_t layer_id, const char* s,
                   std::optional<size_t> len = std::nullopt);
 void PrintInGreen(uint64_t layer_id, char s);
@@ -17,6 +17,8 @@ fi
 
 qemu-system-x86_64 \
     -m 1G \
+    -smp 4 \
+    -cpu max \
     -drive if=pflash,format=raw,readonly,file=$DEVENV_DIR/OVMF_CODE.fd \
     -drive if=pflash,format=raw,file=$DEVENV_DIR/OVMF_VARS.fd \
     -drive if=ide,index=0,media=disk,format=raw,file=$DISK_IMG \